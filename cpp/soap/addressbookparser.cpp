@@ -0,0 +1,324 @@
+/***************************************************************************
+                          addressbookparser.cpp
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "addressbookparser.h"
+
+#include "../../contact/contact.h"
+#include "../../utils/kmessshared.h"
+#include "../../utils/xmlfunctions.h"
+#include "../../kmessdebug.h"
+
+#include <QStringList>
+
+
+#ifdef KMESSDEBUG_HTTPSOAPCONNECTION
+  #define KMESSDEBUG_ADDRESSBOOKSERVICE
+#endif
+
+
+
+// The constructor
+AddressBookParser::AddressBookParser()
+: blp( 0 )
+, hasPersonalInformation( false )
+{
+}
+
+
+
+// Return a new parser, without any results
+SoapElementHandler *AddressBookParser::createEmpty() const
+{
+  return new AddressBookParser();
+}
+
+
+
+// Return the local names of the body elements to extract
+QStringList AddressBookParser::getElementNames() const
+{
+  return QStringList() << "Group" << "Contact" << "ab";
+}
+
+
+
+// Process a group or contact element
+void AddressBookParser::parseElement( const QDomElement &element )
+{
+  if( element.localName() == "Contact" )
+  {
+    parseContact( element );
+  }
+  else if( element.localName() == "Group" )
+  {
+    parseGroup( element );
+  }
+  else if( element.localName() == "ab" )
+  {
+    lastChange = XmlFunctions::getNodeValue( element, "lastChange" );
+  }
+}
+
+
+
+// Parse a contact element
+void AddressBookParser::parseContact( const QDomElement &contact )
+{
+  // Contacts removed since the last change
+  if( XmlFunctions::getNodeValue( contact, "fDeleted" ) == "true" )
+  {
+    deletedContactIds.append( XmlFunctions::getNodeValue( contact, "contactId" ) );
+    return;
+  }
+
+  const QDomNode contactInfo( XmlFunctions::getNode( contact, "contactInfo" ) );
+
+  // Get some user information
+  const QString contactType( XmlFunctions::getNodeValue( contactInfo, "contactType" ) );
+
+  // Check if the contact type is Me: it has the information about personal profile
+  if( contactType == "Me" )
+  {
+    cid = XmlFunctions::getNodeValue( contactInfo, "CID" );
+
+    // Search for "<annotations>...<Annotation><name>MSN.IM.BLP<name><value>VALUE<value><Annotation>.."
+    const QDomNodeList annotations( contactInfo.toElement().elementsByTagName( "Annotation" ) );
+    for( int index = 0; index < annotations.count(); index++ )
+    {
+      const QDomNode annotation( annotations.at( index ) );
+
+      if( XmlFunctions::getNodeValue( annotation, "Name" ) == "MSN.IM.BLP" )
+      {
+        // Set BLP argument
+        blp = XmlFunctions::getNodeValue( annotation, "Value" ).toInt();
+        break;
+      }
+    }
+
+    hasPersonalInformation = true;
+    return;
+  }
+
+  // Non-messenger (i.e, hotmail only) contacts are not skipped: they appear on our AB
+  // list, and we might need to add them one day. If that happens we'll need a Contact
+  // instance to refer to.
+
+  ContactRecord record;
+
+  if( XmlFunctions::getNodeValue( contactInfo, "contactEmailType" ) == "Messenger3" )
+  {
+    record.isMessenger3 = true;
+    record.handle       = XmlFunctions::getNodeValue( contactInfo, "email" ).toLower();
+  }
+  else
+  {
+    record.handle       = XmlFunctions::getNodeValue( contactInfo, "passportName" ).toLower();
+  }
+
+  // The second condition is an HACK, the handle shouldn't be exist in the list of user
+  // indeed is impossible to add it on the contact list because microsoft server doesn't accept
+  // the request. The contact should be removed from the user's list, but for now we prefer to make
+  // easy the life of the users...for the moment..:P
+  if( record.handle.isEmpty() || record.handle == "messenger@microsoft.com" )
+  {
+    kWarning() << "Skipped 'messenger@microsoft.com' contact!";
+    return;
+  }
+
+  // Retrieve the other information about the contact
+  // TODO implement the method for dynamic items,
+  // please refer to msnpiki in the MSNP13 section.
+  // and enable retrieval of the other services in
+  // retrieveMembershipLists().
+
+  // Add display name. The stream parser already decodes UTF-8, only the HTML entities are left
+  record.friendlyName    = KMessShared::htmlUnescape( XmlFunctions::getNodeValue( contactInfo, "displayName" ) );
+  record.contactId       = XmlFunctions::getNodeValue( contact,     "contactId"       );
+  record.isMessengerUser = XmlFunctions::getNodeValue( contactInfo, "isMessengerUser" ) == "true";
+  record.hasSpace        = XmlFunctions::getNodeValue( contactInfo, "hasSpace"        ) == "true";
+
+  // Check if the contact is assigned to any groups
+  const QDomNodeList guids( contactInfo.toElement().elementsByTagName( "guid" ) );
+  for( int i = 0; i < guids.count(); i++ )
+  {
+    record.groupIds.append( internGroupId( guids.item( i ).toElement().text() ) );
+  }
+
+  contacts.append( record );
+}
+
+
+
+// Parse a group element
+void AddressBookParser::parseGroup( const QDomElement &group )
+{
+  const QString groupId(                             XmlFunctions::getNodeValue( group, "groupId"        ) );
+
+  // Groups removed since the last change
+  if( XmlFunctions::getNodeValue( group, "fDeleted" ) == "true" )
+  {
+    deletedGroupIds.append( groupId );
+    return;
+  }
+
+  const QString    name( KMessShared::htmlUnescape( XmlFunctions::getNodeValue( group, "groupInfo/name" ) ) );
+
+  if( groupId.isEmpty() || name.isEmpty() )
+  {
+    return;
+  }
+
+  groups.append( qMakePair( internGroupId( groupId ), name ) );
+}
+
+
+
+/**
+ * @brief Return the shared copy of a group GUID
+ *
+ * There are few groups and many contacts: all the references to a group
+ * share the same string data, instead of allocating a copy for each contact.
+ */
+QString AddressBookParser::internGroupId( const QString &groupId )
+{
+  QHash<QString,QString>::const_iterator it( groupIds_.constFind( groupId ) );
+  if( it != groupIds_.constEnd() )
+  {
+    return it.value();
+  }
+
+  groupIds_.insert( groupId, groupId );
+  return groupId;
+}
+
+
+
+// Return a new parser, without any results
+SoapElementHandler *MembershipListsParser::createEmpty() const
+{
+  return new MembershipListsParser();
+}
+
+
+
+// Return the local names of the body elements to extract
+QStringList MembershipListsParser::getElementNames() const
+{
+  return QStringList() << "Service";
+}
+
+
+
+// Process a service element
+void MembershipListsParser::parseElement( const QDomElement &service )
+{
+  // Get the name of the service
+  QString serviceType( XmlFunctions::getNodeValue( service, "Info/Handle/Type" ) );
+
+  if( serviceType.isEmpty() )
+  {
+    kWarning() << "Retrieved unknown service type!";
+    return;
+  }
+
+  const QDomNodeList memberships( XmlFunctions::getNode( service, "Memberships" ).childNodes() );
+
+  // Keep the most recent change time of all services; the timestamps have all the same format
+  const QString serviceLastChange( XmlFunctions::getNodeValue( service, "LastChange" ) );
+  if( serviceLastChange > lastChange )
+  {
+    lastChange = serviceLastChange;
+  }
+
+  int roleId;
+  QString role;
+  QString handle;
+
+  // Parse the service's membership lists and save the results in the contactsRole hash table
+  QHash<QString,int> contactsRole;
+  QHash<QString,int> deletedContactsRole;
+
+  for( int index = 0; index < memberships.count(); index++ )
+  {
+    // Parse each role structure
+    const QDomNode membership( memberships.item( index ) );
+    role = XmlFunctions::getNodeValue( membership, "MemberRole" );
+
+    roleId = 0;
+    if(      role == "Allow"   ) roleId = Contact::MSN_LIST_ALLOWED;
+    else if( role == "Block"   ) roleId = Contact::MSN_LIST_BLOCKED;
+    else if( role == "Reverse" ) roleId = Contact::MSN_LIST_REVERSE;
+    else if( role == "Pending" ) roleId = Contact::MSN_LIST_PENDING;
+    else
+    {
+      kWarning() << "Unknown membership role" << role << "in service" << serviceType << "!";
+      continue;
+    }
+
+    // Parse each member
+    const QDomNodeList members( membership.toElement().elementsByTagName( "Member" ) );
+    for( int i = 0; i < members.count(); i++ )
+    {
+      // FIXME: This only works for the "Messenger" service. Others don't have the PassportName nor Email nodes.
+      // We need a flexible system!
+      const QDomNode memberNode( members.item( i ) );
+
+      handle = XmlFunctions::getNodeValue( memberNode, "PassportName" ).toLower();
+
+      if( handle.isEmpty() )
+      {
+        handle = XmlFunctions::getNodeValue( memberNode, "Email" ).toLower();
+
+        if( handle.isEmpty() )
+        {
+          continue;
+        }
+      }
+      // HACK: See AddressBookParser::parseContact() for details
+      else if( handle == "messenger@microsoft.com" )
+      {
+        continue;
+      }
+
+      // skip non-passport contacts in the membership lists (ie, Yahoo).
+      // we can't handle them when manipulating the membership lists.
+      QString type = XmlFunctions::getNodeValue( memberNode, "Type" ).toLower();
+      if ( type != "passport" )
+      {
+        kDebug() << "Skipped non-passport contact" << handle;
+        continue;
+      }
+
+      // Roles removed since the last change
+      if( XmlFunctions::getNodeValue( memberNode, "Deleted" ) == "true" )
+      {
+        deletedContactsRole.insert( handle, deletedContactsRole.value( handle, 0 ) | roleId );
+        continue;
+      }
+
+      // Insert the current contact in the hash with their respective role
+      // If the contact is already listed, the new value is OR'ed (set bit flag) with the old roleId
+      contactsRole.insert( handle, contactsRole.value( handle, 0 ) | roleId );
+    }
+  }
+
+  services.append( qMakePair( serviceType, contactsRole ) );
+
+  if( ! deletedContactsRole.isEmpty() )
+  {
+    deletedRoles.insert( serviceType, deletedContactsRole );
+  }
+}
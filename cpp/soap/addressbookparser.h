@@ -0,0 +1,115 @@
+/***************************************************************************
+                          addressbookparser.h
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef ADDRESSBOOKPARSER_H
+#define ADDRESSBOOKPARSER_H
+
+#include "contactrecord.h"
+#include "soapstreamparser.h"
+
+#include <QHash>
+#include <QList>
+#include <QPair>
+
+
+
+/**
+ * @brief Streaming parser for the ABFindAll responses.
+ *
+ * It collects the groups, the contacts and the personal information of the user,
+ * one <code>Group</code> or <code>Contact</code> element at a time, and the time of
+ * the last change to the address book, from the <code>ab</code> element.
+ *
+ * When only the changes are requested, deleted contacts and groups are listed apart.
+ *
+ * @ingroup NetworkSoap
+ */
+class AddressBookParser : public SoapElementHandler
+{
+  public:
+    // The constructor
+                         AddressBookParser();
+
+    // Return a new parser, without any results
+    SoapElementHandler  *createEmpty() const;
+    // Return the local names of the body elements to extract
+    QStringList          getElementNames() const;
+    // Process a group or contact element
+    void                 parseElement( const QDomElement &element );
+
+  private:
+    // Return the shared copy of a group GUID
+    QString              internGroupId( const QString &groupId );
+    // Parse a contact element
+    void                 parseContact( const QDomElement &contact );
+    // Parse a group element
+    void                 parseGroup( const QDomElement &group );
+
+  private:
+    // The group GUIDs found so far, to share them between all the contacts
+    QHash<QString,QString> groupIds_;
+
+  public: // Public properties
+    /// The user's CID, from the "Me" contact
+    QString              cid;
+    /// The user's BLP setting, from the "Me" contact
+    int                  blp;
+    /// The contacts' details
+    ContactRecordList    contacts;
+    /// The IDs of the deleted contacts
+    QStringList          deletedContactIds;
+    /// The IDs of the deleted groups
+    QStringList          deletedGroupIds;
+    /// The groups, as pairs of group ID and name
+    QList< QPair<QString,QString> >  groups;
+    /// Whether the personal information of the user has been found
+    bool                 hasPersonalInformation;
+    /// The time of the last change to the address book
+    QString              lastChange;
+};
+
+
+
+/**
+ * @brief Streaming parser for the FindMembership responses.
+ *
+ * It collects the roles of the contacts of each service, one <code>Service</code> element at a time,
+ * and the time of the last change to the lists.
+ *
+ * When only the changes are requested, the roles which have been removed are listed apart.
+ *
+ * @ingroup NetworkSoap
+ */
+class MembershipListsParser : public SoapElementHandler
+{
+  public:
+    // Return a new parser, without any results
+    SoapElementHandler  *createEmpty() const;
+    // Return the local names of the body elements to extract
+    QStringList          getElementNames() const;
+    // Process a service element
+    void                 parseElement( const QDomElement &element );
+
+  public: // Public properties
+    /// The roles which have been removed from the contacts, by service type
+    QHash< QString,QHash<QString,int> > deletedRoles;
+    /// The time of the last change to the lists
+    QString              lastChange;
+    /// The services, as pairs of service type and the roles of their contacts
+    QList< QPair< QString,QHash<QString,int> > > services;
+};
+
+#endif
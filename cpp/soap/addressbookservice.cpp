@@ -18,13 +18,20 @@
 #include "addressbookservice.h"
 
 #include "../../contact/contact.h"
+#include "../../utils/kmessconfig.h"
 #include "../../utils/kmessshared.h"
 #include "../../utils/xmlfunctions.h"
 #include "../../currentaccount.h"
 #include "../../kmessdebug.h"
+#include "addressbookparser.h"
 #include "soapmessage.h"
 
+#include <QDataStream>
+#include <QFile>
+#include <QSet>
+
 #include <KLocale>
+#include <KSaveFile>
 
 
 #ifdef KMESSDEBUG_HTTPSOAPCONNECTION
@@ -42,6 +49,62 @@
  */
 #define SERVICE_URL_ADDRESSBOOK_SHARING   "https://omega.contacts.msn.com/abservice/SharingService.asmx"
 
+/**
+ * @brief Header of the Address Book requests
+ *
+ * It's used as is by the request templates, and filled by createCommonHeader() for
+ * the other requests. The token placeholder is filled by the base class.
+ */
+#define ADDRESSBOOK_COMMON_HEADER \
+  "<ABApplicationHeader xmlns=\"http://www.msn.com/webservices/AddressBook\">\n" \
+  "  <ApplicationId xmlns=\"http://www.msn.com/webservices/AddressBook\">\n" \
+  "    996CDE1E-AA53-4477-B943-2BE802EA6166\n" \
+  "  </ApplicationId>\n" \
+  "  <IsMigration xmlns=\"http://www.msn.com/webservices/AddressBook\">false</IsMigration>\n" \
+  "  <PartnerScenario xmlns=\"http://www.msn.com/webservices/AddressBook\">%{partnerScenario}</PartnerScenario>\n" \
+  "</ABApplicationHeader>\n" \
+  "<ABAuthHeader xmlns=\"http://www.msn.com/webservices/AddressBook\">\n" \
+  "  <ManagedGroupRequest xmlns=\"http://www.msn.com/webservices/AddressBook\">false</ManagedGroupRequest>\n" \
+  "  <TicketToken>" SOAP_TOKEN_PLACEHOLDER "</TicketToken>\n" \
+  "</ABAuthHeader>"
+
+
+
+/**
+ * @brief Identifier of the address book snapshot files
+ */
+#define ADDRESSBOOK_SNAPSHOT_MAGIC        0x4b4d4142
+
+/**
+ * @brief Format version of the address book snapshot files
+ *
+ * Snapshots with a different version are ignored, and replaced.
+ */
+#define ADDRESSBOOK_SNAPSHOT_VERSION      1
+
+/**
+ * @brief Smallest sizes of the items of the address book snapshot files, in bytes
+ *
+ * Used to detect corrupt item counts: a string takes at least its 4 bytes length.
+ */
+#define ADDRESSBOOK_SNAPSHOT_MIN_STRING_SIZE   4
+#define ADDRESSBOOK_SNAPSHOT_MIN_GROUP_SIZE    ( 2 * ADDRESSBOOK_SNAPSHOT_MIN_STRING_SIZE )
+#define ADDRESSBOOK_SNAPSHOT_MIN_CONTACT_SIZE  ( 3 * ADDRESSBOOK_SNAPSHOT_MIN_STRING_SIZE + 1 + 4 )
+#define ADDRESSBOOK_SNAPSHOT_MIN_SERVICE_SIZE  ( ADDRESSBOOK_SNAPSHOT_MIN_STRING_SIZE + 4 )
+#define ADDRESSBOOK_SNAPSHOT_MIN_MEMBER_SIZE   ( ADDRESSBOOK_SNAPSHOT_MIN_STRING_SIZE + 4 )
+
+/**
+ * @brief Maximum number of contacts changed by a single Address Book request
+ *
+ * The bulk operations split their contacts in requests of this size.
+ */
+#define ADDRESSBOOK_BATCH_SIZE            50
+
+
+
+// Static attributes initialization
+QHash<QString,AddressBookService::AddressBookCache> AddressBookService::caches_;
+
 
 
 /**
@@ -49,7 +112,10 @@
  */
 AddressBookService::AddressBookService( QObject *parent )
 : PassportLoginService( parent )
+, hasSignalledAddressBook_( false )
+, hasSignalledMemberships_( false )
 {
+  preconnect( SERVICE_URL_ADDRESSBOOK );
 }
 
 
@@ -70,75 +136,53 @@ AddressBookService::~AddressBookService()
  */
 void AddressBookService::addContact( const QString &handle, const QStringList& groupsId, bool alreadyExists )
 {
-  // TODO Add support to yahoo contacts
+  sendContactAdd( ContactGroupsList() << qMakePair( handle, groupsId ), alreadyExists );
+}
 
-  QString body( "<ABContactAdd xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
-                "  <abId>00000000-0000-0000-0000-000000000000</abId>\n"
-                "  <contacts>\n"
-                "    <Contact xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
-                "      <contactInfo>\n" );
-  if( ! alreadyExists )
-  {
-    body +=     "        <contactType>Regular</contactType>\n";
-  }
 
-  body +=       "        <passportName>" + handle + "</passportName>\n"
-                "        <isMessengerUser>true</isMessengerUser>\n"
-                "        <MessengerMemberInfo>\n"
-                "          <DisplayName />\n"
-                "        </MessengerMemberInfo>\n"
-                "      </contactInfo>\n"
-                "    </Contact>\n"
-                "  </contacts>\n";
-  if( ! alreadyExists )
+
+/**
+ * @brief Add many new or already known contacts to the Address Book.
+ *
+ * The contacts are sent in requests of up to ADDRESSBOOK_BATCH_SIZE contacts each.
+ * contactAdded() is emitted for each contact which has been added, with its groups, and
+ * contactAddFailed() for each contact which the server refused.
+ *
+ * @param  contacts       The handles of the contacts, each with the IDs of the groups to put it in.
+ * @param  alreadyExists  Whether the contacts are already known, and only need to be added to the Address Book.
+ */
+void AddressBookService::addContacts( const ContactGroupsList &contacts, bool alreadyExists )
+{
+  for( int index = 0; index < contacts.count(); index += ADDRESSBOOK_BATCH_SIZE )
   {
-    body +=     "  <options>\n"
-                "    <EnableAllowListManagement>true</EnableAllowListManagement>\n"
-                "  </options>\n";
+    sendContactAdd( contacts.mid( index, ADDRESSBOOK_BATCH_SIZE ), alreadyExists );
   }
-
-  body +=       "</ABContactAdd>";
-
-  MessageData data;
-  data.type  = "ContactAdd";
-  data.value = QStringList() << handle << groupsId;
-
-  sendSecureRequest( new SoapMessage( SERVICE_URL_ADDRESSBOOK,
-                                      "http://www.msn.com/webservices/AddressBook/ABContactAdd",
-                                      createCommonHeader( "ContactSave" ),
-                                      body,
-                                      data ),
-                     "Contacts" );
 }
 
 
 
 void AddressBookService::addContactToGroup( const QString &contactId, const QString &groupId )
 {
-  QString body( "<ABGroupContactAdd xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
-                "  <abId>00000000-0000-0000-0000-000000000000</abId>\n"
-                "  <groupFilter>\n"
-                "    <groupIds>\n"
-                "      <guid>" + groupId + "</guid>\n"
-                "    </groupIds>\n"
-                "  </groupFilter>\n"
-                "  <contacts>\n"
-                "    <Contact>\n"
-                "      <contactId>" + contactId + "</contactId>\n"
-                "    </Contact>\n"
-                "  </contacts>\n"
-                "</ABGroupContactAdd>" );
+  addContactsToGroup( QStringList() << contactId, groupId );
+}
 
-  MessageData data;
-  data.type  = "ContactAddToGroup";
-  data.value = groupId;
 
-  sendSecureRequest( new SoapMessage( SERVICE_URL_ADDRESSBOOK,
-                                      "http://www.msn.com/webservices/AddressBook/ABGroupContactAdd",
-                                      createCommonHeader( "GroupSave" ),
-                                      body,
-                                      data ),
-                     "Contacts" );
+
+/**
+ * @brief Add many contacts to a group
+ *
+ * The contacts are added with ABGroupContactAdd requests of up to ADDRESSBOOK_BATCH_SIZE
+ * contacts each. contactAddedToGroup() is emitted for each contact.
+ *
+ * @param  contactIds  The IDs of the contacts to add.
+ * @param  groupId     The ID of the group.
+ */
+void AddressBookService::addContactsToGroup( const QStringList &contactIds, const QString &groupId )
+{
+  for( int index = 0; index < contactIds.count(); index += ADDRESSBOOK_BATCH_SIZE )
+  {
+    sendGroupContactsUpdate( contactIds.mid( index, ADDRESSBOOK_BATCH_SIZE ), groupId, true );
+  }
 }
 
 
@@ -182,15 +226,43 @@ void AddressBookService::addGroup( const QString &name )
 // Block contact
 void AddressBookService::blockContact( const QString &handle )
 {
-  SoapMessage *message = getMembershipListUpdate( handle, "Block", true );
+  blockContacts( QStringList() << handle );
+}
 
-  MessageData data;
-  data.type  = "ContactBlock";
-  data.value = QStringList() << handle << "BL";
 
-  message->setData( data );
 
-  sendSecureRequest( message, "Contacts" );
+/**
+ * @brief Block many contacts
+ *
+ * The contacts are added to the Block role with AddMember requests of up to
+ * ADDRESSBOOK_BATCH_SIZE contacts each. contactBlocked() is emitted for each contact.
+ *
+ * @param  handles  The contacts to block.
+ */
+void AddressBookService::blockContacts( const QStringList &handles )
+{
+  sendMembershipListUpdates( handles, "Block", true, "ContactBlock", "BL" );
+}
+
+
+
+/**
+ * @brief Return the contacts of a bulk ABContactAdd request
+ *
+ * @param  data  The data of the request.
+ */
+AddressBookService::ContactGroupsList AddressBookService::getContactsAddList( const MessageData &data )
+{
+  ContactGroupsList contacts;
+
+  foreach( const QVariant &contact, data.value.toMap().value( "contacts" ).toList() )
+  {
+    QStringList info( contact.toStringList() );
+    const QString handle( info.takeFirst() );
+    contacts.append( qMakePair( handle, info ) );
+  }
+
+  return contacts;
 }
 
 
@@ -228,19 +300,11 @@ void AddressBookService::createAddressBook()
  */
 QString AddressBookService::createCommonHeader( const QString partnerScenario )
 {
-  return "<ABApplicationHeader xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
-         "  <ApplicationId xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
-         "    996CDE1E-AA53-4477-B943-2BE802EA6166\n"
-         "  </ApplicationId>\n"
-         "  <IsMigration xmlns=\"http://www.msn.com/webservices/AddressBook\">false</IsMigration>\n"
-         "  <PartnerScenario xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
-         + partnerScenario +
-         "  </PartnerScenario>\n"
-         "</ABApplicationHeader>\n"
-         "<ABAuthHeader xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
-         "  <ManagedGroupRequest xmlns=\"http://www.msn.com/webservices/AddressBook\">false</ManagedGroupRequest>\n"
-         "  <TicketToken />\n" // Gets filled in by the base class
-         "</ABAuthHeader>";
+  QString header( ADDRESSBOOK_COMMON_HEADER );
+
+  header.replace( "%{partnerScenario}", partnerScenario );
+
+  return header;
 }
 
 
@@ -301,55 +365,57 @@ void AddressBookService::contactUpdate( ContactProperty property, const QString
 
 void AddressBookService::deleteContact( const QString &contactId )
 {
-  QString body( "<ABContactDelete xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
-                "  <abId>00000000-0000-0000-0000-000000000000</abId>\n"
-                "  <contacts>\n"
-                "    <Contact>\n"
-                "      <contactId>" + contactId + "</contactId>\n"
-                "    </Contact>\n"
-                "  </contacts>\n"
-                "</ABContactDelete>" );
+  sendContactDelete( QStringList() << contactId );
+}
 
-  MessageData data;
-  data.type  = "ContactDelete";
-  data.value = contactId;
 
-  sendSecureRequest( new SoapMessage( SERVICE_URL_ADDRESSBOOK,
-                                      "http://www.msn.com/webservices/AddressBook/ABContactDelete",
-                                      createCommonHeader( "Timer" ),
-                                      body,
-                                      data ),
-                     "Contacts" );
+
+/**
+ * @brief Delete many contacts from the AB
+ *
+ * The contacts are deleted with ABContactDelete requests of up to batchSize contacts each.
+ * contactDeleted() is emitted for each contact, as soon as its request is done.
+ *
+ * @param  contactIds  The IDs of the contacts to delete.
+ * @param  batchSize   The maximum number of contacts in each request, or 0 for ADDRESSBOOK_BATCH_SIZE.
+ */
+void AddressBookService::deleteContacts( const QStringList &contactIds, int batchSize )
+{
+  if( batchSize <= 0 )
+  {
+    batchSize = ADDRESSBOOK_BATCH_SIZE;
+  }
+
+  for( int index = 0; index < contactIds.count(); index += batchSize )
+  {
+    sendContactDelete( contactIds.mid( index, batchSize ) );
+  }
 }
 
 
 
 void AddressBookService::deleteContactFromGroup( const QString &contactId, const QString &groupId )
 {
-  QString body( "<ABGroupContactDelete xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
-                "  <abId>00000000-0000-0000-0000-000000000000</abId>\n"
-                "  <groupFilter>\n"
-                "    <groupIds>\n"
-                "      <guid>" + groupId + "</guid>\n"
-                "    </groupIds>\n"
-                "  </groupFilter>\n"
-                "  <contacts>\n"
-                "    <Contact>\n"
-                "      <contactId>" + contactId + "</contactId>\n"
-                "    </Contact>\n"
-                "  </contacts>\n"
-                "</ABGroupContactDelete>" );
+  deleteContactsFromGroup( QStringList() << contactId, groupId );
+}
 
-  MessageData data;
-  data.type  = "ContactDeleteFromGroup";
-  data.value = QStringList() << contactId << groupId;
 
-  sendSecureRequest( new SoapMessage( SERVICE_URL_ADDRESSBOOK,
-                                      "http://www.msn.com/webservices/AddressBook/ABGroupContactDelete",
-                                      createCommonHeader( "GroupSave" ),
-                                      body,
-                                      data ),
-                     "Contacts" );
+
+/**
+ * @brief Remove many contacts from a group
+ *
+ * The contacts are removed with ABGroupContactDelete requests of up to ADDRESSBOOK_BATCH_SIZE
+ * contacts each. contactDeletedFromGroup() is emitted for each contact.
+ *
+ * @param  contactIds  The IDs of the contacts to remove.
+ * @param  groupId     The ID of the group.
+ */
+void AddressBookService::deleteContactsFromGroup( const QStringList &contactIds, const QString &groupId )
+{
+  for( int index = 0; index < contactIds.count(); index += ADDRESSBOOK_BATCH_SIZE )
+  {
+    sendGroupContactsUpdate( contactIds.mid( index, ADDRESSBOOK_BATCH_SIZE ), groupId, false );
+  }
 }
 
 
@@ -441,8 +507,21 @@ void AddressBookService::renameGroup( const QString &groupId, const QString &nam
  */
 void AddressBookService::removePending( const QString &handle )
 {
-  SoapMessage *msg = getMembershipListUpdate( handle, "Pending", false );
-  sendSecureRequest( msg, "Contacts" );
+  removePendingContacts( QStringList() << handle );
+}
+
+
+
+/**
+ * @brief Remove many users from the Pending list.
+ *
+ * The contacts are removed with DeleteMember requests of up to ADDRESSBOOK_BATCH_SIZE contacts each.
+ *
+ * @param  handles  The contacts to remove.
+ */
+void AddressBookService::removePendingContacts( const QStringList &handles )
+{
+  sendMembershipListUpdates( handles, "Pending", false, "ContactRemovePending", "PL" );
 }
 
 
@@ -460,14 +539,36 @@ Cookie: MSPAuth=..
  * It goes on with the headers as usual. Must be tested, I don't know if it works, or
  * if the response is identical to that of the current AbFindAll.
  *
+ * If the address book is known, from this session or from the snapshot saved on disk, it's
+ * signalled immediately; then only the changes since then are requested, merged into the
+ * known address book, and the complete address book is signalled again if anything changed.
+ *
  * @param fromTimestamp A timestamp to retrieve only AB changes after a certain moment.
+ *                      By default, the time of the last received change is used.
  */
 void AddressBookService::retrieveAddressBook( const QString &fromTimestamp )
 {
+  const AddressBookCache &cache( getCache() );
+
+  // Show the known address book right away, the server will only send the changes
+  if( ! cache.addressBookLastChange.isEmpty() && ! hasSignalledAddressBook_ )
+  {
+#ifdef KMESSDEBUG_ADDRESSBOOKSERVICE
+    kDebug() << "Using the known address book, from" << cache.addressBookLastChange;
+#endif
+    emitAddressBook( cache );
+  }
+
+  QString lastChange( fromTimestamp );
+  if( lastChange.isEmpty() )
+  {
+    lastChange = cache.addressBookLastChange;
+  }
+
   QString body( "<ABFindAll xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
                 "  <abId>00000000-0000-0000-0000-000000000000</abId>\n"
                 "  <abView>Full</abView>\n" );
-  if( fromTimestamp.isEmpty() )
+  if( lastChange.isEmpty() )
   {
     body +=     "  <deltasOnly>false</deltasOnly>\n"
                 "  <lastChange>0001-01-01T00:00:00.0000000-08:00</lastChange>\n";
@@ -475,45 +576,92 @@ void AddressBookService::retrieveAddressBook( const QString &fromTimestamp )
   else
   {
     body +=     "  <deltasOnly>true</deltasOnly>\n"
-                "  <lastChange>" + fromTimestamp + "</lastChange>\n";
+                "  <lastChange>" + lastChange + "</lastChange>\n";
   }
 
   body +=       "</ABFindAll>";
 
-  sendSecureRequest( new SoapMessage( SERVICE_URL_ADDRESSBOOK,
-                                      "http://www.msn.com/webservices/AddressBook/ABFindAll",
-                                      createCommonHeader(),
-                                      body ),
-                     "Contacts" );
+  MessageData data;
+  data.type  = "AddressBook";
+  data.value = ! lastChange.isEmpty(); // Whether only the changes are requested
+
+  SoapMessage *message = new SoapMessage( SERVICE_URL_ADDRESSBOOK,
+                                          "http://www.msn.com/webservices/AddressBook/ABFindAll",
+                                          createCommonHeader(),
+                                          body,
+                                          data );
+
+  // The address book can be huge, parse it while reading it
+  message->setElementHandler( new AddressBookParser() );
+
+  sendSecureRequest( message, "Contacts" );
 }
 
 
 
 /**
  * @brief Retrieve the membership lists
+ *
+ * Like retrieveAddressBook(), the known lists are signalled immediately, and only the
+ * changes are requested.
  */
 void AddressBookService::retrieveMembershipLists()
 {
-  QString body( "<FindMembership xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
-                "  <serviceFilter xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
-                "    <Types xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
-                "      <ServiceType xmlns=\"http://www.msn.com/webservices/AddressBook\">Messenger</ServiceType>\n"
+  const AddressBookCache &cache( getCache() );
+  const QString lastChange( cache.membershipsLastChange );
+
+  // Show the known lists right away, the server will only send the changes
+  if( ! lastChange.isEmpty() && ! hasSignalledMemberships_ )
+  {
+#ifdef KMESSDEBUG_ADDRESSBOOKSERVICE
+    kDebug() << "Using the known membership lists, from" << lastChange;
+#endif
+    emitMembershipLists( cache );
+  }
+
+  static const SoapRequestTemplate requestTemplate( ADDRESSBOOK_COMMON_HEADER,
+    "<FindMembership xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
+    "  <serviceFilter xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
+    "    <Types xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
+    "      <ServiceType xmlns=\"http://www.msn.com/webservices/AddressBook\">Messenger</ServiceType>\n"
 // TODO: Adding more WLM features may require retrieval of the membership lists for these services
 /*
-                "      <ServiceType xmlns=\"http://www.msn.com/webservices/AddressBook\">Invitation</ServiceType>\n"
-                "      <ServiceType xmlns=\"http://www.msn.com/webservices/AddressBook\">SocialNetwork</ServiceType>\n"
-                "      <ServiceType xmlns=\"http://www.msn.com/webservices/AddressBook\">Space</ServiceType>\n"
-                "      <ServiceType xmlns=\"http://www.msn.com/webservices/AddressBook\">Profile</ServiceType>\n"
+    "      <ServiceType xmlns=\"http://www.msn.com/webservices/AddressBook\">Invitation</ServiceType>\n"
+    "      <ServiceType xmlns=\"http://www.msn.com/webservices/AddressBook\">SocialNetwork</ServiceType>\n"
+    "      <ServiceType xmlns=\"http://www.msn.com/webservices/AddressBook\">Space</ServiceType>\n"
+    "      <ServiceType xmlns=\"http://www.msn.com/webservices/AddressBook\">Profile</ServiceType>\n"
 */
-                "    </Types>\n"
-                "  </serviceFilter>\n"
-                "</FindMembership>" );
+    "    </Types>\n"
+    "  </serviceFilter>\n"
+    "%{*deltas}"
+    "</FindMembership>" );
 
-  sendSecureRequest( new SoapMessage( SERVICE_URL_ADDRESSBOOK_SHARING,
-                                      "http://www.msn.com/webservices/AddressBook/FindMembership",
-                                      createCommonHeader(),
-                                      body ),
-                     "Contacts" );
+  SoapRequestValues values;
+  values.insert( "partnerScenario", "Initial" );
+
+  if( lastChange.isEmpty() )
+  {
+    values.insert( "deltas", QString() );
+  }
+  else
+  {
+    values.insert( "deltas", "  <View>Full</View>\n"
+                             "  <deltasOnly>true</deltasOnly>\n"
+                             "  <lastChange>" + KMessShared::htmlEscape( lastChange ) + "</lastChange>\n" );
+  }
+
+  MessageData data;
+  data.type  = "MembershipLists";
+  data.value = ! lastChange.isEmpty(); // Whether only the changes are requested
+
+  SoapMessage *message = new SoapMessage( SERVICE_URL_ADDRESSBOOK_SHARING,
+                                          "http://www.msn.com/webservices/AddressBook/FindMembership",
+                                          requestTemplate,
+                                          values,
+                                          data );
+  message->setElementHandler( new MembershipListsParser() );
+
+  sendSecureRequest( message, "Contacts" );
 }
 
 
@@ -532,264 +680,550 @@ void AddressBookService::retrieveGleams()
                 "  <dynamicItemLastChange>0001-01-01T00:00:00.0000000-08:00</dynamicItemLastChange>\n"
                 "</ABFindAll>" );
 
-  sendSecureRequest( new SoapMessage( SERVICE_URL_ADDRESSBOOK,
-                                      "http://www.msn.com/webservices/AddressBook/ABFindAll",
-                                      createCommonHeader(),
-                                      body ),
-                     "Contacts" );
+  SoapMessage *message = new SoapMessage( SERVICE_URL_ADDRESSBOOK,
+                                          "http://www.msn.com/webservices/AddressBook/ABFindAll",
+                                          createCommonHeader(),
+                                          body );
+  message->setElementHandler( new AddressBookParser() );
+
+  sendSecureRequest( message, "Contacts" );
 }
 
 
 
-// Parse the address book
-void AddressBookService::parseAddressBook( const QDomElement &body )
+/**
+ * @brief Return the address book data of the current account
+ */
+AddressBookService::AddressBookCache &AddressBookService::getCache()
 {
-#ifdef KMESSDEBUG_ADDRESSBOOKSERVICE
-  kDebug() << "Parsing address book.";
+  const QString handle( CurrentAccount::instance()->getHandle() );
 
-  int debugGroupCount = 0;
-#endif
+  // Load the snapshot saved by a previous session, the first time the account is used
+  if( ! caches_.contains( handle ) )
+  {
+    loadSnapshot( caches_[ handle ], handle );
+  }
 
-  // Parse the adress book lists
-  // First parse the one containing the groups
-  const QDomNodeList groups( body.elementsByTagName( "Group" ) );
+  return caches_[ handle ];
+}
 
-  for( int index = 0; index < groups.count(); index++ )
-  {
-    const QDomNode group( groups.item( index ) );
 
-    const QString groupId(                 XmlFunctions::getNodeValue( group, "groupId"        ) );
-    const QString    name( textNodeDecode( XmlFunctions::getNodeValue( group, "groupInfo/name" ) ) );
 
-    if( groupId.isEmpty() || name.isEmpty() )
-    {
-      continue;
-    }
+/**
+ * @brief Return the path of the address book snapshot of an account
+ */
+QString AddressBookService::getSnapshotPath( const QString &handle )
+{
+  return KMessConfig::instance()->getAccountDirectory( handle ) + "/addressbook.dat";
+}
 
-#ifdef KMESSDEBUG_ADDRESSBOOKSERVICE
-    ++debugGroupCount;
-#endif
-    emit gotGroup( groupId, name );
-  }
 
-  // Then parse the list which contains the contacts
-  const QDomNodeList contactsNode( body.elementsByTagName( "Contact" ) );
-  QList< QHash<QString,QVariant> > contacts;
-  QString handle;
-  QString information;
-  QStringList guidList;
 
-  for( int index = 0; index < contactsNode.count(); index++ )
+/**
+ * @brief Check a count of items read from an address book snapshot
+ *
+ * Each item takes some bytes in the file, so a count of more items than the rest of the file
+ * can hold comes from a corrupt snapshot: the stream is marked as corrupt, so nothing is
+ * allocated for the items, and the snapshot is discarded.
+ *
+ * @param  stream       The stream which is reading the snapshot.
+ * @param  count        The number of items which was read.
+ * @param  minimumSize  The smallest number of bytes which each item takes.
+ * @return Whether the count is valid, and the stream is still readable.
+ */
+bool AddressBookService::checkSnapshotCount( QDataStream &stream, qint32 count, int minimumSize )
+{
+  if( stream.status() != QDataStream::Ok )
   {
-    const QDomNode contact( contactsNode.item( index ) );
-    const QDomNode contactInfo( XmlFunctions::getNode( contact, "contactInfo" ) );
+    return false;
+  }
 
-    // Get some user information
-    const QString contactType( XmlFunctions::getNodeValue( contactInfo, "contactType" ) );
-    const QString friendlyName( textNodeDecode( XmlFunctions::getNodeValue( contactInfo, "displayName" ) ));
+  if( count < 0 || count > stream.device()->bytesAvailable() / minimumSize )
+  {
+    stream.setStatus( QDataStream::ReadCorruptData );
+    return false;
+  }
 
-    // Check if the contact type is Me: it has the information about personal profile
-    if( contactType == "Me" )
-    {
-      const QString cid( XmlFunctions::getNodeValue( contactInfo, "CID" ) );
+  return true;
+}
 
-      // Search for "<annotations>...<Annotation><name>MSN.IM.BLP<name><value>VALUE<value><Annotation>.."
-      const QDomNodeList annotations( contactInfo.toElement().elementsByTagName( "Annotation" ) );
-      int blp = 0; // = 0 fixes compile time warning
-      for( int index2 = 0; index2 < annotations.count(); index2++ )
-      {
-        const QDomNode annotation( annotations.at( index2 ) );
 
-        if( XmlFunctions::getNodeValue( annotation, "Name" ) == "MSN.IM.BLP" )
-        {
-          // Set BLP argument
-          blp = XmlFunctions::getNodeValue( annotation, "Value" ).toInt();
-          break;
-        }
-      }
 
-      emit gotPersonalInformation( cid, blp );
-      continue;
-    }
+/**
+ * @brief Load the address book snapshot of an account
+ *
+ * The file is memory mapped when possible, and read with a QDataStream directly from the mapping.
+ * A snapshot which can't be read is ignored: the full lists will be requested to the server.
+ *
+ * @param  cache   The address book data to fill.
+ * @param  handle  The account whose snapshot to load.
+ * @return Whether the snapshot has been loaded.
+ */
+bool AddressBookService::loadSnapshot( AddressBookCache &cache, const QString &handle )
+{
+  QFile file( getSnapshotPath( handle ) );
+  if( ! file.exists() || ! file.open( QIODevice::ReadOnly ) )
+  {
+    return false;
+  }
 
-      // If the contact is not in our Messenger contact list, skip it.
-      // adam (24 Jul 10): can't skip these users. non-messenger (i.e, hotmail only)
-      // users will appear on our AB list. we might need to add them one day. if that
-      // happens we'll need a Contact instance to refer to.
-//     if( XmlFunctions::getNodeValue( contactInfo, "isMessengerUser" ) == "false" )
-//     {
-//       continue;
-//     }
+  QByteArray buffer;
+  uchar *mapping = file.map( 0, file.size() );
+  if( mapping != 0 )
+  {
+    buffer = QByteArray::fromRawData( reinterpret_cast<const char*>( mapping ), file.size() );
+  }
+  else
+  {
+    buffer = file.readAll();
+  }
 
-    // Store all information about contact in one qhash
-    QHash<QString, QVariant> contactInformations;
+  AddressBookCache snapshot;
+  QDataStream stream( buffer );
+  stream.setVersion( QDataStream::Qt_4_5 );
 
-    if( XmlFunctions::getNodeValue( contactInfo, "contactEmailType" ) == "Messenger3" )
-    {
-      contactInformations.insert( "isMessenger3", 1 );
-      handle = XmlFunctions::getNodeValue( contactInfo, "email" ).toLower();
-    }
-    else
-    {
-      handle = XmlFunctions::getNodeValue( contactInfo, "passportName" ).toLower();
-    }
+  quint32 magic, version;
+  stream >> magic >> version;
 
-    // The second condition is an HACK, the handle shouldn't be exist in the list of user
-    // indeed is impossible to add it on the contact list because microsoft server doesn't accept
-    // the request. The contact should be removed from the user's list, but for now we prefer to make
-    // easy the life of the users...for the moment..:P
-    if( handle.isEmpty() || handle == "messenger@microsoft.com" )
-    {
-      kWarning() << "Skipped 'messenger@microsoft.com' contact!";
-      continue;
-    }
+  if( magic != ADDRESSBOOK_SNAPSHOT_MAGIC || version != ADDRESSBOOK_SNAPSHOT_VERSION )
+  {
+    kWarning() << "Ignoring address book snapshot with unknown format:" << file.fileName();
+    return false;
+  }
 
-    // Add the handle
-    contactInformations.insert( "handle", handle );
-
-    // Retrieve the other information about the contact
-    // TODO implement the method for dynamic items,
-    // please refer to msnpiki in the MSNP13 section.
-    // and enable retrieval of the other services in
-    // retrieveMembershipLists().
-
-    // Add display name
-    contactInformations.insert( "friendlyName", friendlyName );
-    // Grep contact id
-    information = XmlFunctions::getNodeValue( contact, "contactId" );
-    contactInformations.insert( "contactId", information );
-    // Determinate if the contact is messenger user or not
-    information = XmlFunctions::getNodeValue( contactInfo, "isMessengerUser" );
-    contactInformations.insert( "isMessengerUser", information );
-    // Determinate if the contact has a space
-    information = XmlFunctions::getNodeValue( contactInfo, "hasSpace" );
-    contactInformations.insert( "hasSpace", information );
-
-    // Check if the contact is assigned to any groups
-    const QDomNodeList guids( contactInfo.toElement().elementsByTagName( "guid" ) );
-    guidList.clear();
-    if( ! guids.isEmpty() )
+  qint32 blp, count;
+  stream >> snapshot.addressBookLastChange >> snapshot.membershipsLastChange
+         >> snapshot.cid >> blp >> snapshot.hasPersonalInformation;
+  snapshot.blp = blp;
+
+  // The groups; their IDs are shared with the contacts' group lists
+  QHash<QString,QString> groupIds;
+  stream >> count;
+  checkSnapshotCount( stream, count, ADDRESSBOOK_SNAPSHOT_MIN_GROUP_SIZE );
+  for( qint32 index = 0; index < count && stream.status() == QDataStream::Ok; index++ )
+  {
+    QPair<QString,QString> group;
+    stream >> group.first >> group.second;
+    groupIds.insert( group.first, group.first );
+    snapshot.groups.append( group );
+  }
+
+  stream >> count;
+  if( checkSnapshotCount( stream, count, ADDRESSBOOK_SNAPSHOT_MIN_CONTACT_SIZE ) )
+  {
+    snapshot.contacts.reserve( count );
+  }
+  for( qint32 index = 0; index < count && stream.status() == QDataStream::Ok; index++ )
+  {
+    ContactRecord record;
+    quint8 flags;
+    qint32 groupCount;
+    stream >> record.contactId >> record.friendlyName >> record.handle >> flags >> groupCount;
+    checkSnapshotCount( stream, groupCount, ADDRESSBOOK_SNAPSHOT_MIN_STRING_SIZE );
+
+    record.hasSpace        = ( flags & 1 );
+    record.isMessenger3    = ( flags & 2 );
+    record.isMessengerUser = ( flags & 4 );
+
+    for( qint32 groupIndex = 0; groupIndex < groupCount && stream.status() == QDataStream::Ok; groupIndex++ )
     {
-      for( int i = 0; i < guids.count(); i++ )
-      {
-        guidList.append( guids.item( i ).toElement().text() );
-      }
+      QString groupId;
+      stream >> groupId;
+      record.groupIds.append( groupIds.value( groupId, groupId ) );
+    }
+
+    snapshot.contacts.append( record );
+  }
 
-      contactInformations.insert( "guidList", guidList );
+  stream >> count;
+  checkSnapshotCount( stream, count, ADDRESSBOOK_SNAPSHOT_MIN_SERVICE_SIZE );
+  for( qint32 index = 0; index < count && stream.status() == QDataStream::Ok; index++ )
+  {
+    QPair< QString,QHash<QString,int> > service;
+    qint32 memberCount;
+    stream >> service.first >> memberCount;
+    checkSnapshotCount( stream, memberCount, ADDRESSBOOK_SNAPSHOT_MIN_MEMBER_SIZE );
+
+    for( qint32 memberIndex = 0; memberIndex < memberCount && stream.status() == QDataStream::Ok; memberIndex++ )
+    {
+      QString memberHandle;
+      qint32 roles;
+      stream >> memberHandle >> roles;
+      service.second.insert( memberHandle, roles );
     }
 
-    contacts.append( contactInformations );
+    snapshot.services.append( service );
+  }
+
+  // All the strings have been copied, the mapping is not needed anymore
+  const bool isValid = ( stream.status() == QDataStream::Ok );
+  buffer.clear();
+  if( mapping != 0 )
+  {
+    file.unmap( mapping );
+  }
+
+  if( ! isValid )
+  {
+    kWarning() << "Ignoring truncated or corrupt address book snapshot:" << file.fileName();
+    return false;
   }
 
 #ifdef KMESSDEBUG_ADDRESSBOOKSERVICE
-  kDebug() << "Address book successfully parsed: found" << contacts.count() << "contacts and" << debugGroupCount << "groups.";
+  kDebug() << "Loaded address book snapshot with" << snapshot.contacts.count() << "contacts and"
+           << snapshot.groups.count() << "groups.";
 #endif
 
-  // Signal that the of address book has been parsed
-  emit gotAddressBookList( contacts );
+  cache = snapshot;
+  return true;
 }
 
 
 
-// Parse the membership lists
-void AddressBookService::parseMembershipLists( const QDomElement &body )
+/**
+ * @brief Save the address book snapshot of an account
+ *
+ * @param  cache   The address book data to save.
+ * @param  handle  The account whose snapshot to save.
+ */
+void AddressBookService::saveSnapshot( const AddressBookCache &cache, const QString &handle )
 {
-  const QDomNodeList services( body.elementsByTagName( "Service" ) );
-
-  // New, empty accounts have no Services
-  if( services.count() == 0 )
+  KSaveFile file( getSnapshotPath( handle ) );
+  if( ! file.open() )
   {
-    emit gotMembershipLists( "Messenger", QHash<QString,int>() );
+    kWarning() << "Unable to save the address book snapshot:" << file.errorString();
     return;
   }
 
-  for( int serviceIndex = 0; serviceIndex < services.count(); serviceIndex++ )
+  QDataStream stream( &file );
+  stream.setVersion( QDataStream::Qt_4_5 );
+
+  stream << (quint32) ADDRESSBOOK_SNAPSHOT_MAGIC << (quint32) ADDRESSBOOK_SNAPSHOT_VERSION;
+  stream << cache.addressBookLastChange << cache.membershipsLastChange
+         << cache.cid << (qint32) cache.blp << cache.hasPersonalInformation;
+
+  stream << (qint32) cache.groups.count();
+  typedef QPair<QString,QString> Group;
+  foreach( const Group &group, cache.groups )
+  {
+    stream << group.first << group.second;
+  }
+
+  stream << (qint32) cache.contacts.count();
+  foreach( const ContactRecord &record, cache.contacts )
   {
-    const QDomNode service( services.item( serviceIndex ) );
+    const quint8 flags = ( record.hasSpace        ? 1 : 0 )
+                       | ( record.isMessenger3    ? 2 : 0 )
+                       | ( record.isMessengerUser ? 4 : 0 );
+
+    stream << record.contactId << record.friendlyName << record.handle << flags
+           << (qint32) record.groupIds.count();
+
+    foreach( const QString &groupId, record.groupIds )
+    {
+      stream << groupId;
+    }
+  }
 
-    // Get the name of the service
-    QString serviceType( XmlFunctions::getNodeValue( service, "Info/Handle/Type" ) );
+  stream << (qint32) cache.services.count();
+  typedef QPair< QString,QHash<QString,int> > Service;
+  foreach( const Service &service, cache.services )
+  {
+    stream << service.first << (qint32) service.second.count();
 
-    if( serviceType.isEmpty() )
+    QHashIterator<QString,int> it( service.second );
+    while( it.hasNext() )
     {
-      kWarning() << "Retrieved unknown service type!";
-      continue;
+      it.next();
+      stream << it.key() << (qint32) it.value();
     }
+  }
+
+  if( ! file.finalize() )
+  {
+    kWarning() << "Unable to save the address book snapshot:" << file.errorString();
+  }
+}
+
 
-    const QDomNodeList memberships( XmlFunctions::getNode( service, "Memberships" ).childNodes() );
 
-    // TODO Parse the timestamp of current retrieve to update the timestamp in the XML list
-    /*
-    QDomNodeList listInfo = body.elementsByTagName( "LastChange" );
-    QString timestamp( listInfo.item( listInfo.count() - 1 ).toElement().text() );
-    */
+/**
+ * @brief Emit the results of the address book parsing
+ *
+ * The received address book replaces the known one; if only the changes were received,
+ * they're merged into the known one. Either way, the complete address book is signalled.
+ */
+void AddressBookService::processAddressBookResult( SoapMessage *message )
+{
+  const AddressBookParser *parser = dynamic_cast<const AddressBookParser*>( message->getElementHandler() );
+  if( parser == 0 )
+  {
+    kWarning() << "Address book response received without its parser!";
+    return;
+  }
 
-    int roleId;
-    QString role;
-    QString handle;
+  typedef QPair<QString,QString> Group;
+  AddressBookCache &cache( getCache() );
+  const bool isDelta = message->getData().value.toBool();
 
-    // Parse the service's membership lists and save the results in the contactsRole hash table
-    QHash<QString,int> contactsRole;
+  if( ! isDelta )
+  {
+    cache.groups   = parser->groups;
+    cache.contacts = parser->contacts;
+  }
+  else
+  {
+    // Merge the changed groups
+    foreach( const QString &groupId, parser->deletedGroupIds )
+    {
+      for( int index = 0; index < cache.groups.count(); index++ )
+      {
+        if( cache.groups[ index ].first == groupId )
+        {
+          cache.groups.removeAt( index );
+          break;
+        }
+      }
+    }
 
-    for( int index = 0; index < memberships.count(); index++ )
+    foreach( const Group &group, parser->groups )
     {
-      // Parse each role structure
-      const QDomNode membership( memberships.item( index ) );
-      role = XmlFunctions::getNodeValue( membership, "MemberRole" );
-
-      roleId = 0;
-      if(      role == "Allow"   ) roleId = Contact::MSN_LIST_ALLOWED;
-      else if( role == "Block"   ) roleId = Contact::MSN_LIST_BLOCKED;
-      else if( role == "Reverse" ) roleId = Contact::MSN_LIST_REVERSE;
-      else if( role == "Pending" ) roleId = Contact::MSN_LIST_PENDING;
+      int index = 0;
+      while( index < cache.groups.count() && cache.groups[ index ].first != group.first )
+      {
+        ++index;
+      }
+
+      if( index < cache.groups.count() )
+      {
+        cache.groups[ index ] = group;
+      }
       else
       {
-        kWarning() << "Unknown membership role" << role << "in service" << serviceType << "!";
-        continue;
+        cache.groups.append( group );
       }
+    }
+
+    // Merge the changed contacts
+    QHash<QString,int> contactIndexes;
+    contactIndexes.reserve( cache.contacts.count() );
+    for( int index = 0; index < cache.contacts.count(); index++ )
+    {
+      contactIndexes.insert( cache.contacts[ index ].contactId, index );
+    }
 
-      // Parse each member
-      const QDomNodeList members( membership.toElement().elementsByTagName( "Member" ) );
-      for( int i = 0; i < members.count(); i++ )
+    foreach( const ContactRecord &record, parser->contacts )
+    {
+      const int index = contactIndexes.value( record.contactId, -1 );
+      if( index >= 0 )
+      {
+        cache.contacts[ index ] = record;
+      }
+      else
       {
-        // FIXME: This only works for the "Messenger" service. Others don't have the PassportName nor Email nodes.
-        // We need a flexible system!
-        const QDomNode memberNode( members.item( i ) );
+        contactIndexes.insert( record.contactId, cache.contacts.count() );
+        cache.contacts.append( record );
+      }
+    }
 
-        handle = XmlFunctions::getNodeValue( memberNode, "PassportName" ).toLower();
+    if( ! parser->deletedContactIds.isEmpty() )
+    {
+      const QSet<QString> deletedIds( parser->deletedContactIds.toSet() );
 
-        if( handle.isEmpty() )
+      ContactRecordList contacts;
+      contacts.reserve( cache.contacts.count() );
+      foreach( const ContactRecord &record, cache.contacts )
+      {
+        if( ! deletedIds.contains( record.contactId ) )
         {
-          handle = XmlFunctions::getNodeValue( memberNode, "Email" ).toLower();
-
-          if( handle.isEmpty() )
-          {
-            continue;
-          }
+          contacts.append( record );
         }
-        // HACK: See parseAddressBook() for details
-        else if( handle == "messenger@microsoft.com" )
+      }
+
+      cache.contacts = contacts;
+    }
+  }
+
+  if( parser->hasPersonalInformation )
+  {
+    cache.cid                    = parser->cid;
+    cache.blp                    = parser->blp;
+    cache.hasPersonalInformation = true;
+  }
+
+  const QString previousLastChange( cache.addressBookLastChange );
+  if( ! parser->lastChange.isEmpty() )
+  {
+    cache.addressBookLastChange = parser->lastChange;
+  }
+
+#ifdef KMESSDEBUG_ADDRESSBOOKSERVICE
+  kDebug() << "Address book successfully parsed: found" << parser->contacts.count() << "contacts and" << parser->groups.count() << "groups"
+           << ( isDelta ? "changed since the last connection." : "." );
+#endif
+
+  const bool hasChanges = ( ! parser->groups.isEmpty()   || ! parser->deletedGroupIds.isEmpty()
+                         || ! parser->contacts.isEmpty() || ! parser->deletedContactIds.isEmpty() );
+
+  // Only rewrite the snapshot when something changed
+  if( ! isDelta || hasChanges || parser->hasPersonalInformation
+  ||  cache.addressBookLastChange != previousLastChange )
+  {
+    saveSnapshot( cache, CurrentAccount::instance()->getHandle() );
+  }
+
+  // The known address book has been signalled already, and nothing changed
+  if( hasSignalledAddressBook_ && isDelta && ! hasChanges )
+  {
+    return;
+  }
+
+  emitAddressBook( cache );
+}
+
+
+
+// Signal the groups, personal information and contacts of an address book
+void AddressBookService::emitAddressBook( const AddressBookCache &cache )
+{
+  typedef QPair<QString,QString> Group;
+  foreach( const Group &group, cache.groups )
+  {
+    emit gotGroup( group.first, group.second );
+  }
+
+  if( cache.hasPersonalInformation )
+  {
+    emit gotPersonalInformation( cache.cid, cache.blp );
+  }
+
+  hasSignalledAddressBook_ = true;
+
+  // Signal that the of address book has been parsed
+  emit gotContactRecords( cache.contacts );
+
+  // Only build the old list of hashes if someone still wants it
+  if( receivers( SIGNAL( gotAddressBookList(QList<QHash<QString,QVariant> >) ) ) > 0 )
+  {
+    emit gotAddressBookList( contactRecordsToHashes( cache.contacts ) );
+  }
+}
+
+
+
+/**
+ * @brief Emit the results of the membership lists parsing
+ *
+ * Like processAddressBookResult(), the changes are merged into the known lists,
+ * and the complete lists are signalled.
+ */
+void AddressBookService::processMembershipListsResult( SoapMessage *message )
+{
+  const MembershipListsParser *parser = dynamic_cast<const MembershipListsParser*>( message->getElementHandler() );
+  if( parser == 0 )
+  {
+    kWarning() << "Membership lists response received without its parser!";
+    return;
+  }
+
+  typedef QPair< QString,QHash<QString,int> > Service;
+  AddressBookCache &cache( getCache() );
+  const bool isDelta = message->getData().value.toBool();
+
+  if( ! isDelta )
+  {
+    cache.services = parser->services;
+  }
+  else
+  {
+    foreach( const Service &service, parser->services )
+    {
+      int index = 0;
+      while( index < cache.services.count() && cache.services[ index ].first != service.first )
+      {
+        ++index;
+      }
+
+      if( index == cache.services.count() )
+      {
+        cache.services.append( qMakePair( service.first, QHash<QString,int>() ) );
+      }
+
+      QHash<QString,int> &contactsRole( cache.services[ index ].second );
+
+      // Add the new roles
+      QHashIterator<QString,int> it( service.second );
+      while( it.hasNext() )
+      {
+        it.next();
+        contactsRole.insert( it.key(), contactsRole.value( it.key(), 0 ) | it.value() );
+      }
+
+      // Then remove the deleted ones
+      QHashIterator<QString,int> deletedIt( parser->deletedRoles.value( service.first ) );
+      while( deletedIt.hasNext() )
+      {
+        deletedIt.next();
+
+        const int roles = contactsRole.value( deletedIt.key(), 0 ) & ~deletedIt.value();
+        if( roles == 0 )
         {
-          continue;
+          contactsRole.remove( deletedIt.key() );
         }
-
-        // skip non-passport contacts in the membership lists (ie, Yahoo).
-        // we can't handle them when manipulating the membership lists.
-        QString type = XmlFunctions::getNodeValue( memberNode, "Type" ).toLower();
-        if ( type != "passport" )
+        else
         {
-          kDebug() << "Skipped non-passport contact" << handle;
-          continue;
+          contactsRole.insert( deletedIt.key(), roles );
         }
-
-        // Insert the current contact in the hash with their respective role
-        // If the contact is already listed, the new value is OR'ed (set bit flag) with the old roleId
-        contactsRole.insert( handle, contactsRole.value( handle, 0 ) | roleId );
       }
     }
+  }
 
-    // When finished parsing the service's memberships list, signal that its list is ready
-    emit gotMembershipLists( serviceType, contactsRole );
+  const QString previousLastChange( cache.membershipsLastChange );
+  if( ! parser->lastChange.isEmpty() )
+  {
+    cache.membershipsLastChange = parser->lastChange;
+  }
+
+  bool hasChanges = ! parser->deletedRoles.isEmpty();
+  foreach( const Service &service, parser->services )
+  {
+    hasChanges = hasChanges || ! service.second.isEmpty();
+  }
+
+  // Only rewrite the snapshot when something changed
+  if( ! isDelta || hasChanges || cache.membershipsLastChange != previousLastChange )
+  {
+    saveSnapshot( cache, CurrentAccount::instance()->getHandle() );
+  }
+
+  // The known lists have been signalled already, and nothing changed
+  if( hasSignalledMemberships_ && isDelta && ! hasChanges )
+  {
+    return;
+  }
+
+  emitMembershipLists( cache );
+}
+
+
+
+// Signal the membership lists of all services
+void AddressBookService::emitMembershipLists( const AddressBookCache &cache )
+{
+  hasSignalledMemberships_ = true;
+
+  // New, empty accounts have no Services
+  if( cache.services.isEmpty() )
+  {
+    emit gotMembershipLists( "Messenger", QHash<QString,int>() );
+    return;
+  }
+
+  // Signal that each service's list is ready
+  typedef QPair< QString,QHash<QString,int> > Service;
+  foreach( const Service &service, cache.services )
+  {
+    emit gotMembershipLists( service.first, service.second );
   }
 }
 
@@ -821,16 +1255,120 @@ void AddressBookService::parseSecureFault( SoapMessage *message )
   QString     type       ( messageData.type   );
   QVariant    info       ( messageData.value  );
 
+  // One of the contacts of a bulk add was refused: split the request, to find which ones
+  if( type == "ContactsAdd" && faultCode == "soap:Client"
+  &&  ( errorCode == "BadEmailArgument" || errorCode == "InvalidPassportUser" ) )
+  {
+    const ContactGroupsList contacts     ( getContactsAddList( messageData ) );
+    const bool              alreadyExists( info.toMap().value( "alreadyExists" ).toBool() );
+    const int               half         ( contacts.count() / 2 );
+
+#ifdef KMESSDEBUG_ADDRESSBOOKSERVICE
+    kDebug() << "Bulk contact add of" << contacts.count() << "contacts failed with" << errorCode << ", splitting it.";
+#endif
+
+    sendContactAdd( contacts.mid( 0, half ), alreadyExists );
+    sendContactAdd( contacts.mid( half ),    alreadyExists );
+    return;
+  }
+
+  // One of the contacts of a bulk delete doesn't exist anymore: split the request, to delete the others
+  if( type == "ContactDelete" && faultCode == "soap:Client"
+  &&  errorCode == "ContactDoesNotExist" && ! info.toStringList().isEmpty() )
+  {
+    const QStringList contactIds( info.toStringList() );
+
+    // The contact is gone already, like the deletion wanted
+    if( contactIds.count() == 1 )
+    {
+#ifdef KMESSDEBUG_ADDRESSBOOKSERVICE
+      kDebug() << "Contact" << contactIds.first() << "was deleted already.";
+#endif
+
+      emit contactDeleted( contactIds.first() );
+      return;
+    }
+
+    const int half( contactIds.count() / 2 );
+
+#ifdef KMESSDEBUG_ADDRESSBOOKSERVICE
+    kDebug() << "Bulk contact delete of" << contactIds.count() << "contacts failed with" << errorCode << ", splitting it.";
+#endif
+
+    sendContactDelete( contactIds.mid( 0, half ) );
+    sendContactDelete( contactIds.mid( half ) );
+    return;
+  }
+
+  // A group change failed because of one of its contacts: split the request, to change the others
+  if( ( type == "ContactAddToGroup" || type == "ContactDeleteFromGroup" ) && faultCode == "soap:Client"
+  &&  errorCode != "GroupDoesNotExist" && errorCode != "InvalidApplicationHeader"
+  &&  errorCode != "FullSyncRequired"  && errorCode != "ABDoesNotExist" )
+  {
+          QStringList contactIds( info.toStringList() );
+    const QString     groupId   ( contactIds.takeFirst() );
+
+    if( contactIds.count() > 1 )
+    {
+      const int half( contactIds.count() / 2 );
+
+#ifdef KMESSDEBUG_ADDRESSBOOKSERVICE
+      kDebug() << "Group change of" << contactIds.count() << "contacts failed with" << errorCode << ", splitting it.";
+#endif
+
+      sendGroupContactsUpdate( contactIds.mid( 0, half ), groupId, type == "ContactAddToGroup" );
+      sendGroupContactsUpdate( contactIds.mid( half ),    groupId, type == "ContactAddToGroup" );
+      return;
+    }
+
+    kWarning() << "Unable to change the group" << groupId << "of contact" << contactIds.value( 0 ) << ":" << errorCode;
+  }
+
+  // The data of the membership updates lists the name of the list before the handles
+  const bool isMembershipUpdate( type == "ContactBlock" || type == "ContactUnblock" || type == "ContactRemovePending" );
+
+  // One of the contacts of a membership update was refused: split the request, to update the others
+  if( isMembershipUpdate && faultCode == "soap:Client"
+  &&  ( errorCode == "BadEmailArgument" || errorCode == "InvalidPassportUser" ) && info.toStringList().count() > 2 )
+  {
+          QStringList handles ( info.toStringList() );
+    const QString     listName( handles.takeFirst() );
+    const int         half    ( handles.count() / 2 );
+
+    QString role( "Pending" );
+    if( type == "ContactBlock" )
+    {
+      role = "Block";
+    }
+    else if( type == "ContactUnblock" )
+    {
+      role = "Allow";
+    }
+
+#ifdef KMESSDEBUG_ADDRESSBOOKSERVICE
+    kDebug() << "Membership update of" << handles.count() << "contacts failed with" << errorCode << ", splitting it.";
+#endif
+
+    sendMembershipListUpdates( handles.mid( 0, half ), role, type != "ContactRemovePending", type, listName );
+    sendMembershipListUpdates( handles.mid( half ),    role, type != "ContactRemovePending", type, listName );
+    return;
+  }
+
   // See which fault we received
   if( faultCode == "soap:Client" && ! errorCode.isEmpty() )
   {
+    const QString email( info.toStringList().value( isMembershipUpdate ? 1 : 0 ) );
+
     // We forgot to check if the email was valid:
     if( errorCode == "BadEmailArgument" )
     {
-      QString email( info.toStringList().first() );
-
       kWarning() << "Malformed email address found by the server:" << email;
 
+      if( type == "ContactAdd" )
+      {
+        emit contactAddFailed( email );
+      }
+
       emit soapWarning( i18nc( "Warning message",
                                "The specified email address, \"%1\", is not a valid email address!",
                                email ),
@@ -839,7 +1377,10 @@ void AddressBookService::parseSecureFault( SoapMessage *message )
     // The email we tried to add is not an address registered on Passport
     else if( errorCode == "InvalidPassportUser" )
     {
-      QString email( info.toStringList().first() );
+      if( type == "ContactAdd" )
+      {
+        emit contactAddFailed( email );
+      }
 
       emit soapWarning( i18nc( "Error message",
                                "The specified email address, \"%1\", does not belong to a Live Messenger account!",
@@ -853,6 +1394,24 @@ void AddressBookService::parseSecureFault( SoapMessage *message )
                              "Invalid web service request (%1)", message->getFaultDescription() ),
                       MsnSocketBase::ERROR_INTERNAL );
     }
+    // The changes since the last connection are not available anymore: get everything again
+    else if( errorCode == "FullSyncRequired" )
+    {
+#ifdef KMESSDEBUG_ADDRESSBOOKSERVICE
+      kDebug() << "Full synchronization required for" << type << ".";
+#endif
+      if( type == "MembershipLists" )
+      {
+        getCache().membershipsLastChange.clear();
+        retrieveMembershipLists();
+      }
+      else
+      {
+        getCache().addressBookLastChange.clear();
+        retrieveAddressBook();
+      }
+      return;
+    }
     // This is a new account which doesn't have an address book. Create one
     else if( errorCode == "ABDoesNotExist" )
     {
@@ -898,12 +1457,12 @@ void AddressBookService::parseSecureResult( SoapMessage *message )
 
   if( ! body.firstChildElement( "FindMembershipResponse" ).isNull() )
   {
-    parseMembershipLists( body );
+    processMembershipListsResult( message );
     return;
   }
   else if( ! body.firstChildElement( "ABFindAllResponse" ).isNull() )
   {
-    parseAddressBook( body );
+    processAddressBookResult( message );
     return;
   }
   else if( ! body.firstChildElement( "ABContactUpdateResponse" ).isNull() )
@@ -944,57 +1503,95 @@ void AddressBookService::parseSecureResult( SoapMessage *message )
       emit contactAdded( handle, contactId, groupsId );
     }
   }
-  else if( data.type == "ContactDelete" )
+  else if( data.type == "ContactsAdd" )
   {
-    // A contact was deleted from the AB
+    // Many contacts were added to the AB: the IDs are in the same order as the contacts
 
-    const QString contactId( data.value.toString() );
+    const ContactGroupsList contacts  ( getContactsAddList( data ) );
+    const QDomNodeList      contactIds( body.elementsByTagName( "guid" ) );
 
-    if( ! contactId.isEmpty() )
+    if( contactIds.count() == (uint) contacts.count() )
+    {
+      for( int index = 0; index < contacts.count(); ++index )
+      {
+        const QString contactId( contactIds.item( index ).toElement().text() );
+        const QString handle   ( contacts.at( index ).first );
+
+        if( contactId.isEmpty() )
+        {
+          emit contactAddFailed( handle );
+        }
+        else
+        {
+          emit contactAdded( handle, contactId, contacts.at( index ).second );
+        }
+      }
+    }
+    else
     {
-      emit contactDeleted( contactId );
+      // The contacts can't be matched to their IDs: get them with the address book changes
+      kWarning() << "Received" << contactIds.count() << "contact IDs for" << contacts.count()
+                 << "added contacts, retrieving the address book changes.";
+
+      retrieveAddressBook();
     }
   }
-  else if( data.type == "ContactBlock" || data.type == "ContactUnblock" )
+  else if( data.type == "ContactDelete" )
   {
-    // A contact was added to the Membership list in a certain Role
-
-    const QStringList info  ( data.value.toStringList() );
-    const QString     handle( info.value( 0 ) );
-    const QString     role  ( info.value( 1 ) );
+    // Contacts were deleted from the AB
 
-    if( role == "BL" )
+    foreach( const QString &contactId, data.value.toStringList() )
     {
-      emit contactBlocked( handle );
-    }
-    else if( role == "AL" )
-    {
-      emit contactUnblocked( handle );
+      if( ! contactId.isEmpty() )
+      {
+        emit contactDeleted( contactId );
+      }
     }
   }
-  else if( data.type == "ContactAddToGroup" )
+  else if( data.type == "ContactBlock" || data.type == "ContactUnblock" )
   {
-    // A contact was added to a group
+    // Contacts were added to the Membership list in a certain Role
 
-    const QString groupId  ( data.value.toString() );
-    const QString contactId( body.elementsByTagName( "guid" ).item(0).toElement().text() );
+          QStringList handles( data.value.toStringList() );
+    const QString     role   ( handles.takeFirst() );
 
-    if( ! contactId.isEmpty() && ! groupId.isEmpty() )
+    foreach( const QString &handle, handles )
     {
-      emit contactAddedToGroup( contactId, groupId );
+      if( role == "BL" )
+      {
+        emit contactBlocked( handle );
+      }
+      else if( role == "AL" )
+      {
+        emit contactUnblocked( handle );
+      }
     }
   }
-  else if( data.type == "ContactDeleteFromGroup" )
+  else if( data.type == "ContactAddToGroup" || data.type == "ContactDeleteFromGroup" )
   {
-    // A contact was removed from a group
+    // Contacts were added to, or removed from, a group
 
-    const QStringList info     ( data.value.toStringList() );
-    const QString     contactId( info.value( 0 ) );
-    const QString     groupId  ( info.value( 1 ) );
+          QStringList contactIds( data.value.toStringList() );
+    const QString     groupId   ( contactIds.takeFirst() );
 
-    if( ! contactId.isEmpty() && ! groupId.isEmpty() )
+    if( ! groupId.isEmpty() )
     {
-      emit contactDeletedFromGroup( contactId, groupId );
+      foreach( const QString &contactId, contactIds )
+      {
+        if( contactId.isEmpty() )
+        {
+          continue;
+        }
+
+        if( data.type == "ContactAddToGroup" )
+        {
+          emit contactAddedToGroup( contactId, groupId );
+        }
+        else
+        {
+          emit contactDeletedFromGroup( contactId, groupId );
+        }
+      }
     }
   }
   else if( data.type == "GroupAdd" )
@@ -1038,18 +1635,223 @@ void AddressBookService::parseSecureResult( SoapMessage *message )
 
 
 
+/**
+ * @brief Send an ABContactDelete request
+ *
+ * @param  contactIds  The IDs of the contacts to delete, all in the same request.
+ */
+void AddressBookService::sendContactDelete( const QStringList &contactIds )
+{
+  QString contacts;
+  foreach( const QString &contactId, contactIds )
+  {
+    contacts += "    <Contact>\n"
+                "      <contactId>" + contactId + "</contactId>\n"
+                "    </Contact>\n";
+  }
+
+  QString body( "<ABContactDelete xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
+                "  <abId>00000000-0000-0000-0000-000000000000</abId>\n"
+                "  <contacts>\n"
+                + contacts +
+                "  </contacts>\n"
+                "</ABContactDelete>" );
+
+  MessageData data;
+  data.type  = "ContactDelete";
+  data.value = contactIds;
+
+  sendSecureRequest( new SoapMessage( SERVICE_URL_ADDRESSBOOK,
+                                      "http://www.msn.com/webservices/AddressBook/ABContactDelete",
+                                      createCommonHeader( "Timer" ),
+                                      body,
+                                      data ),
+                     "Contacts" );
+}
+
+
+
+/**
+ * @brief Send an ABGroupContactAdd or ABGroupContactDelete request
+ *
+ * @param  contactIds  The IDs of the contacts to add or remove, all in the same request.
+ * @param  groupId     The ID of the group.
+ * @param  adding      Whether to add the contacts to the group, or to remove them.
+ */
+void AddressBookService::sendGroupContactsUpdate( const QStringList &contactIds, const QString &groupId, bool adding )
+{
+  const QString action( adding ? "ABGroupContactAdd" : "ABGroupContactDelete" );
+
+  QString contacts;
+  foreach( const QString &contactId, contactIds )
+  {
+    contacts += "    <Contact>\n"
+                "      <contactId>" + contactId + "</contactId>\n"
+                "    </Contact>\n";
+  }
+
+  QString body( "<" + action + " xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
+                "  <abId>00000000-0000-0000-0000-000000000000</abId>\n"
+                "  <groupFilter>\n"
+                "    <groupIds>\n"
+                "      <guid>" + groupId + "</guid>\n"
+                "    </groupIds>\n"
+                "  </groupFilter>\n"
+                "  <contacts>\n"
+                + contacts +
+                "  </contacts>\n"
+                "</" + action + ">" );
+
+  MessageData data;
+  data.type  = ( adding ? "ContactAddToGroup" : "ContactDeleteFromGroup" );
+  data.value = QStringList() << groupId << contactIds;
+
+  sendSecureRequest( new SoapMessage( SERVICE_URL_ADDRESSBOOK,
+                                      "http://www.msn.com/webservices/AddressBook/" + action,
+                                      createCommonHeader( "GroupSave" ),
+                                      body,
+                                      data ),
+                     "Contacts" );
+}
+
+
+
+/**
+ * @brief Update the membership list of many contacts, in batches
+ *
+ * @param  handles    The contacts to update.
+ * @param  role       The membership role, like "Allow", "Block" or "Pending".
+ * @param  adding     Whether to add the contacts to the role, or to remove them.
+ * @param  dataType   The type of the request data, to signal the results and to split failed batches.
+ * @param  listName   The short name of the list, given with the results.
+ */
+void AddressBookService::sendMembershipListUpdates( const QStringList &handles, const QString &role, bool adding,
+                                                    const QString &dataType, const QString &listName )
+{
+  for( int index = 0; index < handles.count(); index += ADDRESSBOOK_BATCH_SIZE )
+  {
+    const QStringList batch( handles.mid( index, ADDRESSBOOK_BATCH_SIZE ) );
+    SoapMessage *message = getMembershipListUpdate( batch, role, adding );
+
+    MessageData data;
+    data.type  = dataType;
+    data.value = QStringList() << listName << batch;
+
+    message->setData( data );
+
+    sendSecureRequest( message, "Contacts" );
+  }
+}
+
+
+
+/**
+ * @brief Send an ABContactAdd request
+ *
+ * A request with a single contact keeps the simpler "ContactAdd" data, so the server
+ * errors about the contact can be reported with its handle.
+ *
+ * @param  contacts       The handles of the contacts, each with the IDs of the groups to put it in.
+ * @param  alreadyExists  Whether the contacts are already known, and only need to be added to the Address Book.
+ */
+void AddressBookService::sendContactAdd( const ContactGroupsList &contacts, bool alreadyExists )
+{
+  // TODO Add support to yahoo contacts
+
+  static const SoapRequestTemplate requestTemplate( ADDRESSBOOK_COMMON_HEADER,
+    "<ABContactAdd xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
+    "  <abId>00000000-0000-0000-0000-000000000000</abId>\n"
+    "  <contacts>\n"
+    "%{*contacts}"
+    "  </contacts>\n"
+    "%{*options}"
+    "</ABContactAdd>" );
+
+  if( contacts.isEmpty() )
+  {
+    return;
+  }
+
+  const QString contactType( alreadyExists ? QString() : "        <contactType>Regular</contactType>\n" );
+  QString       contactsList;
+  QVariantList  contactsInfo;
+
+  for( ContactGroupsList::const_iterator it = contacts.constBegin(); it != contacts.constEnd(); ++it )
+  {
+    contactsList += "    <Contact xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
+                    "      <contactInfo>\n"
+                    + contactType +
+                    "        <passportName>" + KMessShared::htmlEscape( it->first ) + "</passportName>\n"
+                    "        <isMessengerUser>true</isMessengerUser>\n"
+                    "        <MessengerMemberInfo>\n"
+                    "          <DisplayName />\n"
+                    "        </MessengerMemberInfo>\n"
+                    "      </contactInfo>\n"
+                    "    </Contact>\n";
+
+    contactsInfo.append( QStringList() << it->first << it->second );
+  }
+
+  SoapRequestValues values;
+  values.insert( "partnerScenario", "ContactSave" );
+  values.insert( "contacts",        contactsList );
+
+  if( alreadyExists )
+  {
+    values.insert( "options", QString() );
+  }
+  else
+  {
+    values.insert( "options", "  <options>\n"
+                              "    <EnableAllowListManagement>true</EnableAllowListManagement>\n"
+                              "  </options>\n" );
+  }
+
+  MessageData data;
+  if( contacts.count() == 1 )
+  {
+    data.type  = "ContactAdd";
+    data.value = contactsInfo.first();
+  }
+  else
+  {
+    QVariantMap info;
+    info.insert( "contacts",      contactsInfo );
+    info.insert( "alreadyExists", alreadyExists );
+
+    data.type  = "ContactsAdd";
+    data.value = info;
+  }
+
+  sendSecureRequest( new SoapMessage( SERVICE_URL_ADDRESSBOOK,
+                                      "http://www.msn.com/webservices/AddressBook/ABContactAdd",
+                                      requestTemplate,
+                                      values,
+                                      data ),
+                     "Contacts" );
+}
+
+
+
 // Unblock contact
 void AddressBookService::unblockContact( const QString &handle )
 {
-  SoapMessage *message = getMembershipListUpdate( handle, "Allow", true );
+  unblockContacts( QStringList() << handle );
+}
 
-  MessageData data;
-  data.type  = "ContactUnblock";
-  data.value = QStringList() << handle << "AL";
 
-  message->setData( data );
 
-  sendSecureRequest( message, "Contacts" );
+/**
+ * @brief Unblock many contacts
+ *
+ * The contacts are added to the Allow role with AddMember requests of up to
+ * ADDRESSBOOK_BATCH_SIZE contacts each. contactUnblocked() is emitted for each contact.
+ *
+ * @param  handles  The contacts to unblock.
+ */
+void AddressBookService::unblockContacts( const QStringList &handles )
+{
+  sendMembershipListUpdates( handles, "Allow", true, "ContactUnblock", "AL" );
 }
 
 
@@ -1057,6 +1859,32 @@ void AddressBookService::unblockContact( const QString &handle )
 // Create a message to update the membership list
 SoapMessage *AddressBookService::getMembershipListUpdate( const QString &handle, const QString &role, bool adding )
 {
+  return getMembershipListUpdate( QStringList() << handle, role, adding );
+}
+
+
+
+/**
+ * @brief Create a message to update the membership list of many contacts
+ *
+ * All the contacts are added to, or removed from, the same role with a single request.
+ *
+ * @param  handles  The contacts to update.
+ * @param  role     The membership role, like "Allow", "Block" or "Pending".
+ * @param  adding   Whether to add the contacts to the role, or to remove them.
+ */
+SoapMessage *AddressBookService::getMembershipListUpdate( const QStringList &handles, const QString &role, bool adding )
+{
+  QString members;
+  foreach( const QString &handle, handles )
+  {
+    members += "        <Member xsi:type=\"PassportMember\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\">\n"
+               "          <Type>Passport</Type>\n"
+               "          <State>Accepted</State>\n"
+               "          <PassportName>" + KMessShared::htmlEscape( handle ) + "</PassportName>\n"
+               "        </Member>\n";
+  }
+
   QString body( "xmlns=\"http://www.msn.com/webservices/AddressBook\">\n"
                 "  <serviceHandle>\n"
                 "    <Id>0</Id>\n"
@@ -1067,11 +1895,7 @@ SoapMessage *AddressBookService::getMembershipListUpdate( const QString &handle,
                 "    <Membership>\n"
                 "      <MemberRole>" + role + "</MemberRole>\n"
                 "      <Members>\n"
-                "        <Member xsi:type=\"PassportMember\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\">\n"
-                "          <Type>Passport</Type>\n"
-                "          <State>Accepted</State>\n"
-                "          <PassportName>" + handle + "</PassportName>\n"
-                "        </Member>\n"
+                + members +
                 "      </Members>\n"
                 "    </Membership>\n"
                 "  </memberships>\n" );
@@ -18,12 +18,18 @@
 #ifndef ADDRESSBOOK_H
 #define ADDRESSBOOK_H
 
+#include "contactrecord.h"
 #include "passportloginservice.h"
 
 #include <QHash>
+#include <QList>
+#include <QPair>
 #include <QStringList>
 
 
+class QDataStream;
+
+
 /**
  * @brief Soap actions for retrieve the address book and membership lists.
  *
@@ -36,6 +42,9 @@ class AddressBookService : public PassportLoginService
   Q_OBJECT
 
   public:
+    /// A list of contact handles, each with a list of group IDs
+    typedef QList< QPair<QString,QStringList> > ContactGroupsList;
+
     enum ContactProperty
     {
       PROPERTY_FRIENDLYNAME = 0,
@@ -48,28 +57,42 @@ class AddressBookService : public PassportLoginService
     virtual            ~AddressBookService();
     // Add contact to AB
     void                addContact( const QString &handle, const QStringList& groupsId = QStringList(), bool alreadyExists = false );
+    // Add many contacts to AB
+    void                addContacts( const ContactGroupsList &contacts, bool alreadyExists = false );
     // Add contact to group
     void                addContactToGroup( const QString &contactId, const QString &groupId );
+    // Add many contacts to group
+    void                addContactsToGroup( const QStringList &contactIds, const QString &groupId );
     // Add group
     void                addGroup( const QString &name );
     // Block contact
     void                blockContact( const QString &handle );
+    // Block many contacts
+    void                blockContacts( const QStringList &handles );
     // Put the Soap action to update the information about contact
     void                contactUpdate( ContactProperty property, const QString &newValue );
     // Delete contact
     void                deleteContact( const QString &contactId );
+    // Delete many contacts
+    void                deleteContacts( const QStringList &contactIds, int batchSize = 0 );
     // Delete contact from group
     void                deleteContactFromGroup( const QString &contactId, const QString &groupId );
+    // Delete many contacts from group
+    void                deleteContactsFromGroup( const QStringList &contactIds, const QString &groupId );
     // Delete group
     void                deleteGroup( const QString &groupId );
     // Create a message to update the membership list
     SoapMessage        *getMembershipListUpdate( const QString &handle, const QString &role, bool adding );
+    // Create a message to update the membership list of many contacts
+    SoapMessage        *getMembershipListUpdate( const QStringList &handles, const QString &role, bool adding );
     // Mark a contact as a Messenger user
     void                markMessengerUser( const QString &contactId );
     // Rename group
     void                renameGroup( const QString &groupId, const QString &name );
     // Remove a user from the PL
     void                removePending( const QString &handle );
+    // Remove many users from the PL
+    void                removePendingContacts( const QStringList &handles );
     // Retrieve the address book
     void                retrieveAddressBook( const QString &fromTimestamp = QString() );
     // Retrieve the membership lists
@@ -78,24 +101,94 @@ class AddressBookService : public PassportLoginService
     void                retrieveGleams();
     // Unblock contact
     void                unblockContact( const QString &handle );
+    // Unblock many contacts
+    void                unblockContacts( const QStringList &handles );
+
+  private: // Private structures
+    /**
+     * @brief The address book data received during this session
+     *
+     * The changes received on reconnection are merged into it. It's also saved
+     * on disk after each change, and loaded back in the next session.
+     */
+    struct AddressBookCache
+    {
+      AddressBookCache() : blp( 0 ), hasPersonalInformation( false ) {}
+
+      /// The time of the last change to the address book
+      QString           addressBookLastChange;
+      /// The user's BLP setting
+      int               blp;
+      /// The user's CID
+      QString           cid;
+      /// The contacts' details
+      ContactRecordList contacts;
+      /// The groups, as pairs of group ID and name
+      QList< QPair<QString,QString> > groups;
+      /// Whether the personal information of the user has been received
+      bool              hasPersonalInformation;
+      /// The time of the last change to the membership lists
+      QString           membershipsLastChange;
+      /// The roles of the contacts, for each service
+      QList< QPair< QString,QHash<QString,int> > > services;
+    };
 
   private: // private methods
     // Request creation of a new address book (for new accounts)
     void                createAddressBook();
     // Create the common header for the soap requests
     QString             createCommonHeader( const QString partnerScenario = "Initial" );
-    // Parse the address book
-    void                parseAddressBook( const QDomElement &body );
-    // Parse the membership lists
-    void                parseMembershipLists( const QDomElement &body );
+    // Signal the groups, personal information and contacts of an address book
+    void                emitAddressBook( const AddressBookCache &cache );
+    // Signal the membership lists of all services
+    void                emitMembershipLists( const AddressBookCache &cache );
     // Parse a SOAP error message.
     void                parseSecureFault( SoapMessage *message );
     // Parse the result of the response from the server
     void                parseSecureResult( SoapMessage *message );
+    // Emit the results of the address book parsing
+    void                processAddressBookResult( SoapMessage *message );
+    // Emit the results of the membership lists parsing
+    void                processMembershipListsResult( SoapMessage *message );
+    // Send an ABContactAdd request
+    void                sendContactAdd( const ContactGroupsList &contacts, bool alreadyExists );
+    // Send an ABContactDelete request
+    void                sendContactDelete( const QStringList &contactIds );
+    // Send an ABGroupContactAdd or ABGroupContactDelete request
+    void                sendGroupContactsUpdate( const QStringList &contactIds, const QString &groupId, bool adding );
+    // Update the membership list of many contacts, in batches
+    void                sendMembershipListUpdates( const QStringList &handles, const QString &role, bool adding,
+                                                   const QString &dataType, const QString &listName );
+
+  private: // Private static methods
+    // Check a count of items read from an address book snapshot
+    static bool         checkSnapshotCount( QDataStream &stream, qint32 count, int minimumSize );
+    // Return the address book data of the current account
+    static AddressBookCache &getCache();
+    // Return the contacts of a bulk ABContactAdd request
+    static ContactGroupsList getContactsAddList( const MessageData &data );
+    // Return the path of the address book snapshot of an account
+    static QString      getSnapshotPath( const QString &handle );
+    // Load the address book snapshot of an account
+    static bool         loadSnapshot( AddressBookCache &cache, const QString &handle );
+    // Save the address book snapshot of an account
+    static void         saveSnapshot( const AddressBookCache &cache, const QString &handle );
+
+  private: // Private attributes
+    /// Whether the address book has been signalled during this connection
+    bool                hasSignalledAddressBook_;
+    /// Whether the membership lists have been signalled during this connection
+    bool                hasSignalledMemberships_;
+
+  private: // Private static attributes
+    /// The address book data of each account, kept between connections
+    static QHash<QString,AddressBookCache> caches_;
 
   signals: // Contact Address Book signals
     // Contact was added
     void                contactAdded( const QString &handle, const QString &contactId, const QStringList &groupsId );
+    // Contact could not be added
+    void                contactAddFailed( const QString &handle );
     // Contact was added to group
     void                contactAddedToGroup( const QString &contactId, const QString &groupId );
     // Contact was blocked
@@ -123,6 +216,8 @@ class AddressBookService : public PassportLoginService
     // Received information about the logged in contact
     void                gotPersonalInformation( const QString &cid, int blp );
     // The address book was entirely received and parsed
+    void                gotContactRecords( const ContactRecordList &contacts );
+    // The address book was entirely received and parsed, in the old format. Prefer gotContactRecords().
     void                gotAddressBookList( const QList< QHash<QString,QVariant> > &contacts );
 };
 
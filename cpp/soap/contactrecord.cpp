@@ -0,0 +1,73 @@
+/***************************************************************************
+                          contactrecord.cpp
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "contactrecord.h"
+
+
+
+// The constructor
+ContactRecord::ContactRecord()
+: hasSpace( false )
+, isMessenger3( false )
+, isMessengerUser( false )
+{
+}
+
+
+
+/**
+ * @brief Return the details in the format of the old contact details hash
+ *
+ * The keys and the value types are the same which the address book parsing used to produce.
+ */
+QHash<QString,QVariant> ContactRecord::toHash() const
+{
+  QHash<QString,QVariant> contactInformations;
+
+  if( isMessenger3 )
+  {
+    contactInformations.insert( "isMessenger3", 1 );
+  }
+
+  contactInformations.insert( "handle",          handle );
+  contactInformations.insert( "friendlyName",    friendlyName );
+  contactInformations.insert( "contactId",       contactId );
+  contactInformations.insert( "isMessengerUser", QString( isMessengerUser ? "true" : "false" ) );
+  contactInformations.insert( "hasSpace",        QString( hasSpace        ? "true" : "false" ) );
+
+  if( ! groupIds.isEmpty() )
+  {
+    contactInformations.insert( "guidList", groupIds );
+  }
+
+  return contactInformations;
+}
+
+
+
+// Convert a list of contact records to the old list of contact details hashes
+QList< QHash<QString,QVariant> > contactRecordsToHashes( const ContactRecordList &records )
+{
+  QList< QHash<QString,QVariant> > contacts;
+  contacts.reserve( records.count() );
+
+  foreach( const ContactRecord &record, records )
+  {
+    contacts.append( record.toHash() );
+  }
+
+  return contacts;
+}
@@ -0,0 +1,75 @@
+/***************************************************************************
+                          contactrecord.h
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef CONTACTRECORD_H
+#define CONTACTRECORD_H
+
+#include <QHash>
+#include <QList>
+#include <QMetaType>
+#include <QString>
+#include <QStringList>
+#include <QVariant>
+#include <QVector>
+
+
+
+/**
+ * @brief The details of an address book contact.
+ *
+ * This is the compact version of the contact details hash which was emitted by
+ * AddressBookService::gotAddressBookList(): the fields are plain members, and
+ * the group GUIDs are shared between all contacts of the same group.
+ *
+ * @ingroup NetworkSoap
+ */
+class ContactRecord
+{
+  public:
+    // The constructor
+                 ContactRecord();
+
+    // Return the details in the format of the old contact details hash
+    QHash<QString,QVariant> toHash() const;
+
+  public: // Public properties
+    /// The contact's address book ID
+    QString      contactId;
+    /// The contact's friendly name
+    QString      friendlyName;
+    /// The GUIDs of the groups the contact belongs to
+    QStringList  groupIds;
+    /// The contact's email address
+    QString      handle;
+    /// Whether the contact has a space
+    bool         hasSpace;
+    /// Whether the contact is a Messenger3 (non-passport email) contact
+    bool         isMessenger3;
+    /// Whether the contact is a Messenger user
+    bool         isMessengerUser;
+};
+
+Q_DECLARE_TYPEINFO( ContactRecord, Q_MOVABLE_TYPE );
+
+/// A list of contact records, stored contiguously
+typedef QVector<ContactRecord> ContactRecordList;
+
+Q_DECLARE_METATYPE( ContactRecordList )
+
+// Convert a list of contact records to the old list of contact details hashes
+QList< QHash<QString,QVariant> > contactRecordsToHashes( const ContactRecordList &records );
+
+#endif
@@ -23,14 +23,16 @@
 #include "../../kmessdebug.h"
 #include "../mimemessage.h"
 #include "soapmessage.h"
+#include "soapparsejob.h"
+#include "soapredirectioncache.h"
+#include "soaptransport.h"
 #include "config-kmess.h"
 
 #include <QAuthenticator>
-#include <QMutexLocker>
-#include <QNetworkAccessManager>
 #include <QNetworkRequest>
 #include <QNetworkReply>
 #include <QSslError>
+#include <QTime>
 
 #include <KLocale>
 
@@ -44,12 +46,61 @@
 /**
  * Maximum allowed time between a request and its response
  *
- * KMess will wait at most this number of milliseconds after sending a request.
- * If no response arrives and this timeout expires, an error signal will be
- * emitted.
+ * KMess will wait at most this number of milliseconds after sending a request,
+ * or after the last data received for it. It's also the timeout of the actions
+ * whose latency is not known yet.
  */
 #define SOAPCONNECTION_RESPONSE_TIMEOUT     60000
 
+/**
+ * Minimum timeout of a request, in milliseconds
+ *
+ * The timeout of each action is derived from its latency, but never gets shorter than this.
+ */
+#define SOAPCONNECTION_MINIMUM_RESPONSE_TIMEOUT  10000
+
+/**
+ * Factor applied to the usual latency of an action to get its timeout
+ */
+#define SOAPCONNECTION_TIMEOUT_LATENCY_FACTOR    4
+
+/**
+ * Number of latencies kept for each action; the timeout is derived from their 95th percentile
+ */
+#define SOAPCONNECTION_LATENCY_SAMPLES      50
+
+/**
+ * Number of latencies needed before an action gets its own timeout
+ */
+#define SOAPCONNECTION_MINIMUM_LATENCY_SAMPLES   5
+
+/**
+ * Number of times a request which can be repeated is sent again after a timeout
+ */
+#define SOAPCONNECTION_MAX_RETRIES          1
+
+/**
+ * Default number of requests which can be sent at the same time
+ *
+ * Requests which only read data (like the address book and the membership lists
+ * at login) are sent in parallel, up to this number of requests. Requests which
+ * change data are always sent alone. Further requests wait in the queue until a
+ * response arrives.
+ */
+#define SOAPCONNECTION_MAX_CONCURRENT_REQUESTS  4
+
+/**
+ * Delay between two requests, only used with Qt versions which need it
+ *
+ * @see HttpSoapConnection::hasRequestCleanupBug()
+ */
+#define SOAPCONNECTION_BUGGY_QT_REQUEST_DELAY   250
+
+
+
+// Latencies of the recent responses, by action
+QHash<QString,QList<int> > HttpSoapConnection::latencies_;
+
 
 
 /**
@@ -63,28 +114,17 @@
 HttpSoapConnection::HttpSoapConnection( QObject *parent )
 : QObject( parent )
 , currentRequest_( 0 )
-, isSending_( false )
+, maxConcurrentRequests_( SOAPCONNECTION_MAX_CONCURRENT_REQUESTS )
+, queueSentCount_( 0 )
 {
 #ifdef KMESSDEBUG_HTTPSOAPCONNECTION_GENERAL
   kDebug() << "CREATED.";
 #endif
 
-  // Create the network request object
-  http_ = new QNetworkAccessManager( this );
-
-  // Make signal connections
-  connect( http_, SIGNAL(                   finished(QNetworkReply*)                         ),
-           this,  SLOT  (        slotRequestFinished(QNetworkReply*)                         ) );
-  connect( http_, SIGNAL(     authenticationRequired(QNetworkReply*,QAuthenticator*)         ),
-           this,  SLOT  ( slotAuthenticationRequired(QNetworkReply*,QAuthenticator*)         ) );
-  connect( http_, SIGNAL(                  sslErrors(QNetworkReply*,const QList<QSslError>&) ),
-           this,  SLOT  (              slotSslErrors(QNetworkReply*,const QList<QSslError>&) ) );
-
-  // Initialize the timeout timer
-  responseTimer_.setSingleShot( true );
-  responseTimer_.setInterval( SOAPCONNECTION_RESPONSE_TIMEOUT );
-  connect( &responseTimer_, SIGNAL(            timeout() ),
-            this,           SLOT  ( slotRequestTimeout() ) );
+  // The requests are sent over the connections shared by all services; the other
+  // signals are connected to each reply, since the replies of other services go through the same manager
+  connect( SoapTransport::instance(), SIGNAL(     authenticationRequired(QNetworkReply*,QAuthenticator*) ),
+           this,                      SLOT  ( slotAuthenticationRequired(QNetworkReply*,QAuthenticator*) ) );
 }
 
 
@@ -92,13 +132,12 @@ HttpSoapConnection::HttpSoapConnection( QObject *parent )
 /**
  * @brief The destructor.
  *
- * Closes the sockets if these are still open.
+ * Aborts the requests which are still in progress.
  */
 HttpSoapConnection::~HttpSoapConnection()
 {
-  qDeleteAll( requests_ );
-  delete currentRequest_;
-  delete http_;
+  // The replies belong to the shared transport, release them explicitly
+  abort();
 
 #ifdef KMESSDEBUG_HTTPSOAPCONNECTION_GENERAL
   kDebug() << "DESTROYED.";
@@ -110,17 +149,109 @@ HttpSoapConnection::~HttpSoapConnection()
 /**
  * @brief Abort all queued requests
  *
- * This removes any pending requests and ignores responses for already sent messages.
+ * This removes any pending requests and aborts the requests which were already sent.
  */
 void HttpSoapConnection::abort()
 {
   qDeleteAll( requests_ );
   requests_.clear();
 
-  delete currentRequest_;
-  currentRequest_ = 0;
+  // Abort the sent requests
+  foreach( QNetworkReply *reply, pendingRequests_.keys() )
+  {
+    releaseReply( reply );
+  }
+
+  qDeleteAll( pendingRequests_ );
+  pendingRequests_.clear();
+  receivedReplies_.clear();
+  retryCounts_.clear();
+  cancelParseJobs();
+}
+
+
+
+/**
+ * @brief Stop parsing the replies
+ *
+ * The jobs which are still running are only released here: they will be deleted when
+ * their worker thread is done with them, and will not signal their results.
+ */
+void HttpSoapConnection::cancelParseJobs()
+{
+  foreach( const QSharedPointer<SoapParseJob> &job, replyJobs_ )
+  {
+    job->cancel();
+  }
+
+  replyJobs_.clear();
+  replyDumps_.clear();
+}
+
 
-  responseTimer_.stop();
+
+/**
+ * @brief Create a HTTP request to an endpoint
+ *
+ * The known host redirections are applied, and the headers common to
+ * all requests are set.
+ *
+ * @param  endpointAddress  The URL of the endpoint.
+ * @return The request, without contents.
+ */
+QNetworkRequest HttpSoapConnection::createNetworkRequest( const QString &endpointAddress ) const
+{
+  QNetworkRequest request;
+  QUrl            endpoint( endpointAddress );
+
+  // Transparently handle host redirections
+  const QString targetHost( SoapRedirectionCache::instance()->getTarget( endpoint.host() ) );
+  if( ! targetHost.isEmpty() )
+  {
+    endpoint.setHost( targetHost );
+
+#ifdef KMESSDEBUG_HTTPSOAPCONNECTION_GENERAL
+    kDebug() << "Sending with redirection from:" << endpointAddress << "to:" << endpoint;
+#endif
+  }
+
+
+#ifdef KMESSTEST
+  KMESS_ASSERT( endpoint.isValid() );
+  KMESS_ASSERT( ( endpoint.scheme() == "http" ) || ( endpoint.scheme() == "https" ) );
+#endif
+
+  // Set the request header
+  request.setUrl      ( endpoint                                                         );
+  request.setRawHeader( "Host",                               endpoint.host().toLatin1() );
+  request.setRawHeader( "Accept",                             "*/*"                      );
+  request.setRawHeader( "User-Agent",                         "KMess/" KMESS_VERSION     );
+  request.setRawHeader( "Connection",                         "Keep-Alive"               );
+  request.setRawHeader( "Cache-Control",                      "no-cache"                 );
+
+#ifdef KMESSTEST
+  // Redirect to another server if started with --server
+  if( static_cast<KMessApplication*>( kapp )->getUseTestServer() )
+  {
+    endpoint.setHost( static_cast<KMessApplication*>( kapp )->getTestServer() );
+    endpoint.setPort( 4430 );
+    request.setUrl( endpoint );
+  }
+#endif
+
+  return request;
+}
+
+
+
+/**
+ * @brief Return the key of a request in the latency statistics
+ *
+ * The RST requests have no action, their endpoint is used instead.
+ */
+QString HttpSoapConnection::getLatencyKey( const SoapMessage *message )
+{
+  return message->getAction().isEmpty() ? message->getEndPoint() : message->getAction();
 }
 
 
@@ -128,7 +259,7 @@ void HttpSoapConnection::abort()
 /**
  * @brief Return the current request message, if any
  *
- * It only returns a message if a request is currently being sent, or if its response is being processed.
+ * It only returns a message while its response is being processed.
  *
  * @param   copy  If true, creates a copy of the request message.
  * @return  Returns a message if one is being sent or processed, otherwise returns 0.
@@ -147,13 +278,105 @@ SoapMessage *HttpSoapConnection::getCurrentRequest( bool copy ) const
 
 
 
+/**
+ * @brief Return whether the running Qt library needs a delay between requests
+ *
+ * Qt 4.5.1 doesn't clean up correctly after each request, so the next request can
+ * only be sent after a short delay. The check is done at run time, since the Qt
+ * library KMess runs with may differ from the one it was compiled against.
+ */
+bool HttpSoapConnection::hasRequestCleanupBug()
+{
+  static const bool hasBug = QString( qVersion() ).startsWith( "4.5.1" );
+  return hasBug;
+}
+
+
+
+/**
+ * @brief Return the maximum number of requests which can be sent at the same time
+ */
+int HttpSoapConnection::getMaximumConcurrentRequests() const
+{
+  return maxConcurrentRequests_;
+}
+
+
+
+/**
+ * @brief Return how long to wait for the response to a request
+ *
+ * The timeout is a multiple of the 95th percentile of the recent latencies of the
+ * same action, so a stuck request is detected long before the global timeout, while
+ * the actions which are always slow, like ABFindAll on big address books, get more time.
+ *
+ * @param  message  The request.
+ * @return The timeout in milliseconds.
+ */
+int HttpSoapConnection::getResponseTimeout( const SoapMessage *message )
+{
+  QList<int> samples( latencies_.value( getLatencyKey( message ) ) );
+  if( samples.count() < SOAPCONNECTION_MINIMUM_LATENCY_SAMPLES )
+  {
+    return SOAPCONNECTION_RESPONSE_TIMEOUT;
+  }
+
+  qSort( samples );
+  const int percentile = samples.at( ( samples.count() * 95 + 99 ) / 100 - 1 );
+
+  return qBound( SOAPCONNECTION_MINIMUM_RESPONSE_TIMEOUT,
+                 percentile * SOAPCONNECTION_TIMEOUT_LATENCY_FACTOR,
+                 SOAPCONNECTION_RESPONSE_TIMEOUT );
+}
+
+
+
+/**
+ * @brief Return whether a request which changes data is waiting for its response
+ */
+bool HttpSoapConnection::hasPendingChange() const
+{
+  foreach( const SoapMessage *message, pendingRequests_ )
+  {
+    if( ! message->isIdempotent() )
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+
 /**
  * @brief Return whether the connection is idle.
  * @return  Returns true when the connection is idle, false when a SOAP request is pending / being processed.
  */
 bool HttpSoapConnection::isIdle()
 {
-  return ( ! isSending_ );
+  return pendingRequests_.isEmpty();
+}
+
+
+
+/**
+ * @brief Change the maximum number of requests which can be sent at the same time
+ *
+ * Use 1 to send the requests strictly one at a time, in the order they were queued.
+ *
+ * @param  maximum  The number of requests which can wait for a response at the same time.
+ */
+void HttpSoapConnection::setMaximumConcurrentRequests( int maximum )
+{
+#ifdef KMESSTEST
+  KMESS_ASSERT( maximum > 0 );
+#endif
+
+  maxConcurrentRequests_ = qMax( 1, maximum );
+
+  // The window may have grown, send what fits in it now
+  sendNextRequest();
 }
 
 
@@ -270,81 +493,228 @@ void HttpSoapConnection::parseSoapFault( SoapMessage *message )
 
 
 /**
- * @brief  Send the next request in queue to the endpoint.
+ * @brief  A request failed without a SOAP response.
+ *
+ * Called when the request could not be sent, timed out, or got an invalid response,
+ * right before the soapError() or soapWarning() signal is emitted. The request is
+ * deleted afterwards. Overwrite this method to clean up the state which waits for
+ * the response.
+ *
+ * @param  request  The request which failed.
  */
-void HttpSoapConnection::sendNextRequest()
+void HttpSoapConnection::requestFailed( SoapMessage *request )
 {
-  if( isSending_ || requests_.isEmpty() )
+  Q_UNUSED( request );
+}
+
+
+
+/**
+ * @brief Remember how long it took to receive a response
+ *
+ * @param  message  The request.
+ * @param  latency  Milliseconds between the request and the end of its response.
+ */
+void HttpSoapConnection::recordLatency( const SoapMessage *message, int latency )
+{
+  QList<int> &samples = latencies_[ getLatencyKey( message ) ];
+
+  samples.append( latency );
+  if( samples.count() > SOAPCONNECTION_LATENCY_SAMPLES )
   {
-    return;
+    samples.removeFirst();
   }
+}
 
-#ifdef KMESSTEST
-  KMESS_ASSERT( currentRequest_ == 0 );
-#endif
 
-  // We're sending from now on, block further sending attempts
-  isSending_ = true;
 
-  // Get the request to send
-  currentRequest_ = requests_.takeFirst();
+/**
+ * @brief Stop the processing of a reply, and release it
+ *
+ * The reply is disconnected first, since aborting it fires its finished() signal.
+ * The request it belongs to is not deleted.
+ *
+ * @param  reply  The reply to release.
+ */
+void HttpSoapConnection::releaseReply( QNetworkReply *reply )
+{
+  reply->disconnect( this );
+  reply->abort();
+  reply->deleteLater();
 
-  // Verify if the request we're sending is valid
-  if( ! currentRequest_->isValid() )
+  const QSharedPointer<SoapParseJob> job( replyJobs_.take( reply ) );
+  if( ! job.isNull() )
   {
-    // Inform listeners that the request could not be sent (and disconnect)
-    emit soapError( i18nc( "Error message (system-generated description)",
-                           "Invalid web service request (%1)", currentRequest_->getFaultDescription() ),
-                    MsnSocketBase::ERROR_INTERNAL );
-
-    // Reset the internal data
-    delete currentRequest_;
-    currentRequest_ = 0;
-    isSending_ = false;
-    return;
+    job->cancel();
   }
 
-  const QString  &endpointAddress = currentRequest_->getEndPoint();
+  receivedReplies_.remove( reply );
+  replyDumps_     .remove( reply );
+  replySentTimes_ .remove( reply );
+  replyTimers_    .remove( reply );
+}
 
-  QNetworkRequest request;
-  QUrl            endpoint( endpointAddress );
-  QByteArray      contents( currentRequest_->getMessage() );
-  QString         soapAction( currentRequest_->getAction() );
 
-  // Transparently handle host redirections
-  if( redirections_.contains( endpoint.host() ) )
+
+/**
+ * @brief  Send the next requests in queue to the endpoint.
+ *
+ * Requests are sent until the maximum number of concurrent requests is reached.
+ * Only the requests which read data overlap: a request which changes data waits
+ * for all the requests in progress, and is sent alone, so the changes reach the
+ * server, and complete, in the order they were queued.
+ */
+void HttpSoapConnection::sendNextRequest()
+{
+  while( ! requests_.isEmpty() && pendingRequests_.count() < maxConcurrentRequests_ )
   {
-    endpoint.setHost( redirections_[ endpoint.host() ] );
+    // Keep the changes in order
+    if( hasPendingChange() || ( ! requests_.first()->isIdempotent() && ! pendingRequests_.isEmpty() ) )
+    {
+      return;
+    }
+
+    // Get the request to send
+    SoapMessage *message = requests_.takeFirst();
+
+    // Verify if the request we're sending is valid
+    if( ! message->isValid() )
+    {
+      requestFailed( message );
+
+      // Inform listeners that the request could not be sent (and disconnect)
+      emit soapError( i18nc( "Error message (system-generated description)",
+                             "Invalid web service request (%1)", message->getFaultDescription() ),
+                      MsnSocketBase::ERROR_INTERNAL );
+
+      delete message;
+      return;
+    }
+
+    QNetworkRequest request( createNetworkRequest( message->getEndPoint() ) );
 
 #ifdef KMESSDEBUG_HTTPSOAPCONNECTION_GENERAL
-    kDebug() << "Sending with redirection from:" << endpointAddress << "to:" << endpoint;
+    QTime serializationTime;
+    serializationTime.start();
 #endif
-  }
 
+    QByteArray      contents( message->getMessage() );
+    QString         soapAction( message->getAction() );
 
-#ifdef KMESSTEST
-  KMESS_ASSERT( endpoint.isValid() );
-  KMESS_ASSERT( ( endpoint.scheme() == "http" ) || ( endpoint.scheme() == "https" ) );
+#ifdef KMESSDEBUG_HTTPSOAPCONNECTION_GENERAL
+    kDebug() << "Serialized" << contents.size() << "bytes in" << serializationTime.elapsed() << "ms"
+             << ( message->hasTemplate() ? "(from template)" : "(from DOM)" );
 #endif
 
-  // Set the request header
-  request.setUrl      ( endpoint                                                         );
-  request.setHeader   ( QNetworkRequest::ContentTypeHeader,   "text/xml; charset=utf-8"  );
-  request.setHeader   ( QNetworkRequest::ContentLengthHeader, contents.size()            );
-  request.setRawHeader( "Host",                               endpoint.host().toLatin1() );
-  request.setRawHeader( "Accept",                             "*/*"                      );
-  request.setRawHeader( "User-Agent",                         "KMess/" KMESS_VERSION     );
-  request.setRawHeader( "Connection",                         "Keep-Alive"               );
-  request.setRawHeader( "Cache-Control",                      "no-cache"                 );
+    const bool isCompressionAccepted = setContentsHeaders( request, soapAction, contents.size() );
+
+    // Remember which request the reply will belong to
+    QNetworkReply *reply = SoapTransport::instance()->post( request, contents );
+    pendingRequests_.insert( reply, message );
+    ++queueSentCount_;
+
+    // Parse the reply while it arrives, in a worker thread
+    const QSharedPointer<SoapParseJob> job( SoapParseJob::create( *message ) );
+    job->setCompressionAccepted( isCompressionAccepted );
+    replyJobs_.insert( reply, job );
+    connect( job.data(), SIGNAL(             parsed() ),
+             this,       SLOT  ( slotResponseParsed() ), Qt::QueuedConnection );
+    connect( reply,      SIGNAL(            readyRead() ),
+             this,       SLOT  (   slotReplyReadyRead() ) );
+    connect( reply,      SIGNAL(             finished() ),
+             this,       SLOT  (  slotRequestFinished() ) );
+    connect( reply,      SIGNAL( sslErrors(const QList<QSslError>&) ),
+             this,       SLOT  ( slotSslErrors(const QList<QSslError>&) ) );
+
+    // Start the response timer of the request; it's deleted with the reply
+    QTimer *responseTimer = new QTimer( reply );
+    responseTimer->setSingleShot( true );
+    responseTimer->setInterval( getResponseTimeout( message ) );
+    connect( responseTimer, SIGNAL(            timeout() ),
+             this,          SLOT  ( slotRequestTimeout() ) );
+    responseTimer->start();
+
+    replyTimers_.insert( reply, responseTimer );
+    replySentTimes_[ reply ].start();
 
-#ifdef KMESSTEST
-  // Redirect to another server if started with --server
-  if( static_cast<KMessApplication*>( kapp )->getUseTestServer() )
+#ifdef KMESS_NETWORK_WINDOW
+    QUrl soapActionUrl( soapAction );
+    if( ! soapAction.isEmpty() && soapActionUrl.isValid() )
+    {
+      KMESS_NET_INIT( this, "SOAP " + soapActionUrl.path() );
+    }
+    else
+    {
+      KMESS_NET_INIT( this, "SOAP " + request.url().path() );
+    }
+
+    KMESS_NET_SENT( this, contents );
+#endif
+
+#ifdef KMESSDEBUG_HTTPSOAPCONNECTION_HTTPDUMP
+    kDebug() << "Request contents:";
+    kDebug() << contents;
+#endif
+  }
+}
+
+
+
+/**
+ * @brief Send a SOAP request whose response doesn't matter
+ *
+ * The request is sent right away, outside of the queue, and the connection doesn't wait for
+ * its response: the reply belongs to the shared transport, and is deleted when it finishes.
+ * This allows a service to send its last requests while it's being destroyed.
+ *
+ * @param  message  The message to send. It's deleted right away.
+ */
+void HttpSoapConnection::sendDetachedRequest( SoapMessage *message )
+{
+  if( ! message->isValid() )
   {
-    endpoint.setHost( static_cast<KMessApplication*>( kapp )->getTestServer() );
-    endpoint.setPort( 4430 );
-    request.setUrl( endpoint );
+    kWarning() << "Not sending invalid request:" << message->getFaultDescription();
+    delete message;
+    return;
   }
+
+  const QByteArray contents( message->getMessage() );
+
+  QNetworkRequest request( createNetworkRequest( message->getEndPoint() ) );
+  setContentsHeaders( request, message->getAction(), contents.size() );
+
+  QNetworkReply *reply = SoapTransport::instance()->post( request, contents );
+  connect( reply, SIGNAL(    finished() ),
+           reply, SLOT  ( deleteLater() ) );
+
+#ifdef KMESSDEBUG_HTTPSOAPCONNECTION_GENERAL
+  kDebug() << "Sent detached request to endpoint:" << message->getEndPoint();
+#endif
+
+  delete message;
+}
+
+
+
+/**
+ * @brief Set the headers which describe the contents of a request
+ *
+ * @param  request     The HTTP request.
+ * @param  soapAction  The SOAP action of the contents, if any.
+ * @param  size        The size of the contents.
+ * @return Whether compressed responses have been asked for: only then the parsing job has to decompress them.
+ */
+bool HttpSoapConnection::setContentsHeaders( QNetworkRequest &request, const QString &soapAction, int size )
+{
+  bool isCompressionAccepted = false;
+
+  request.setHeader( QNetworkRequest::ContentTypeHeader,   "text/xml; charset=utf-8" );
+  request.setHeader( QNetworkRequest::ContentLengthHeader, size                      );
+
+#if ! defined( KMESSDEBUG_HTTPSOAPCONNECTION_HTTPDUMP ) && ! defined( KMESS_NETWORK_WINDOW )
+  // Accept compressed responses; they're decompressed by the parsing job. The dumps need plain text.
+  request.setRawHeader( "Accept-Encoding", "gzip, deflate" );
+  isCompressionAccepted = true;
 #endif
 
   if( ! soapAction.isNull() )
@@ -353,29 +723,23 @@ void HttpSoapConnection::sendNextRequest()
     request.setRawHeader( "SOAPAction", quotedAction.toLatin1() );
   }
 
-  http_->post( request, contents );
+  return isCompressionAccepted;
+}
 
-  // Start the response timer
-  responseTimer_.start();
 
-#ifdef KMESS_NETWORK_WINDOW
-  QUrl soapActionUrl( soapAction );
-  if( ! soapAction.isEmpty() && soapActionUrl.isValid() )
-  {
-    KMESS_NET_INIT( this, "SOAP " + soapActionUrl.path() );
-  }
-  else
-  {
-    KMESS_NET_INIT( this, "SOAP " + endpoint.path()      );
-  }
 
-  KMESS_NET_SENT( this, contents );
-#endif
-
-#ifdef KMESSDEBUG_HTTPSOAPCONNECTION_HTTPDUMP
-  kDebug() << "Request contents:";
-  kDebug() << contents;
-#endif
+/**
+ * @brief Open a connection to an endpoint in advance
+ *
+ * Services call this for the endpoints they will surely use, so the first request
+ * doesn't have to wait for the TCP and TLS handshakes. Connections are shared by
+ * all services: nothing is done if one to the same host is still open.
+ *
+ * @param  endpointAddress  The URL of the endpoint.
+ */
+void HttpSoapConnection::preconnect( const QString &endpointAddress )
+{
+  SoapTransport::instance()->preconnect( createNetworkRequest( endpointAddress ) );
 }
 
 
@@ -403,6 +767,13 @@ void HttpSoapConnection::sendRequest( SoapMessage *message, bool urgent )
   }
 #endif
 
+  // Start measuring how long it takes to handle all queued requests
+  if( requests_.isEmpty() && pendingRequests_.isEmpty() )
+  {
+    queueTime_.start();
+    queueSentCount_ = 0;
+  }
+
   if( urgent )
   {
     requests_.prepend( message );
@@ -423,8 +794,14 @@ void HttpSoapConnection::sendRequest( SoapMessage *message, bool urgent )
  */
 void HttpSoapConnection::slotAuthenticationRequired( QNetworkReply *reply, QAuthenticator *authenticator )
 {
+  // The request of another service
+  if( ! pendingRequests_.contains( reply ) )
+  {
+    return;
+  }
+
   // A response has arrived, stop the timeout detection timer
-  responseTimer_.stop();
+  replyTimers_.value( reply )->stop();
 
   kWarning() << "Got http authentication request for" << authenticator->realm() <<
                 "while connecting to" << reply->url();
@@ -438,22 +815,124 @@ void HttpSoapConnection::slotAuthenticationRequired( QNetworkReply *reply, QAuth
 
 
 
-// The request to the remote server finished
-void HttpSoapConnection::slotRequestFinished( QNetworkReply *reply )
+/**
+ * @brief Called when a reply has received a new chunk of data
+ *
+ * The data is handed to the reply's parsing job right away, so the parsing overlaps
+ * with the download, and the raw response never needs to be held in memory as a whole.
+ */
+void HttpSoapConnection::slotReplyReadyRead()
 {
-  QMutexLocker locker( &lockMutex_ );
+  QNetworkReply *reply = qobject_cast<QNetworkReply*>( sender() );
 
-  // An unexpected response has arrived
-  if( currentRequest_ == 0 )
+  // The request may have been aborted
+  const QSharedPointer<SoapParseJob> job( replyJobs_.value( reply ) );
+  if( job.isNull() )
   {
-    kWarning() << "No request in progress!";
     return;
   }
 
-  // A response has arrived, stop the timeout detection timer
-  responseTimer_.stop();
+  // Data is flowing, the server is not stuck
+  replyTimers_.value( reply )->start();
+
+  const QByteArray chunk( reply->readAll() );
+
+#if defined( KMESSDEBUG_HTTPSOAPCONNECTION_HTTPDUMP ) || defined( KMESS_NETWORK_WINDOW )
+  replyDumps_[ reply ].append( chunk );
+#endif
+
+  job->setContentEncoding( reply->rawHeader( "Content-Encoding" ) );
+  job->addData( chunk );
+}
+
+
+
+/**
+ * @brief Called when the request to the remote server finished
+ *
+ * The last chunk of data is handed to the reply's parsing job; the response is then
+ * processed by slotResponseParsed(), when the job has completed.
+ */
+void HttpSoapConnection::slotRequestFinished()
+{
+  QNetworkReply *reply = qobject_cast<QNetworkReply*>( sender() );
+  const QSharedPointer<SoapParseJob> job( replyJobs_.value( reply ) );
+
+  // An unexpected response has arrived, or the request was aborted
+  if( ! pendingRequests_.contains( reply ) || job.isNull() )
+  {
+    kWarning() << "No request in progress for reply from" << reply->url() << "!";
+    reply->deleteLater();
+    return;
+  }
+
+  receivedReplies_.insert( reply );
+
+  // The response has arrived: stop the timeout detection timer
+  replyTimers_.value( reply )->stop();
+
+  if( reply->error() == QNetworkReply::NoError )
+  {
+    recordLatency( pendingRequests_.value( reply ), replySentTimes_.value( reply ).elapsed() );
+  }
+
+  // Parse the last chunk of data, if any
+  const QByteArray lastChunk( reply->readAll() );
+
+#if defined( KMESSDEBUG_HTTPSOAPCONNECTION_HTTPDUMP ) || defined( KMESS_NETWORK_WINDOW )
+  replyDumps_[ reply ].append( lastChunk );
+#endif
+
+  job->setContentEncoding( reply->rawHeader( "Content-Encoding" ) );
+  job->finish( lastChunk );
+}
+
+
+
+/**
+ * @brief Called when the response to a request has been parsed
+ *
+ * The reply is still alive at this point, so its status can be checked, and the
+ * results are delivered to the services from the thread which owns them.
+ */
+void HttpSoapConnection::slotResponseParsed()
+{
+  const SoapParseJob *finishedJob = qobject_cast<SoapParseJob*>( sender() );
+  QNetworkReply      *reply       = 0;
+
+  // Find the reply which the job belongs to
+  QHashIterator<QNetworkReply*,QSharedPointer<SoapParseJob> > it( replyJobs_ );
+  while( it.hasNext() )
+  {
+    it.next();
+    if( it.value().data() == finishedJob )
+    {
+      reply = it.key();
+      break;
+    }
+  }
+
+  // The request was aborted in the meanwhile
+  if( reply == 0 )
+  {
+    return;
+  }
+
+  // Keep the job alive until the response has been processed
+  const QSharedPointer<SoapParseJob> job( replyJobs_.take( reply ) );
+  SoapMessage *request = pendingRequests_.take( reply );
+  receivedReplies_.remove( reply );
+  replySentTimes_ .remove( reply );
+  replyTimers_    .remove( reply );
+  retryCounts_    .remove( request );
+
+  // Make the request available to the parsing methods
+  currentRequest_ = request;
+
+#if defined( KMESSDEBUG_HTTPSOAPCONNECTION_HTTPDUMP ) || defined( KMESS_NETWORK_WINDOW )
+  const QByteArray replyContents( replyDumps_.take( reply ) );
+#endif
 
-  const QByteArray& replyContents = reply->readAll();
   const int         statusCode    = reply->attribute( QNetworkRequest::HttpStatusCodeAttribute   ).toInt();
   const QString     error         ( reply->attribute( QNetworkRequest::HttpReasonPhraseAttribute ).toString() );
 
@@ -473,9 +952,19 @@ void HttpSoapConnection::slotRequestFinished( QNetworkReply *reply )
   kDebug() << document.toString();
 #endif
 
-  // Parse the body of the HTTP response (copying the other attributes from the request)
-  SoapMessage *currentResponse = getCurrentRequest( true /* copy */ );
-  currentResponse->setMessage( replyContents );
+  // The response was parsed by the job, starting from a copy of the request
+  SoapMessage *currentResponse = new SoapMessage( job->getResponse() );
+
+  // Keep track of how much the compression saves
+  ResponseSizes &sizes = responseSizes_[ request->getAction() ];
+  sizes.wireBytes    += job->getWireSize();
+  sizes.decodedBytes += job->getDecodedSize();
+
+#ifdef KMESSDEBUG_HTTPSOAPCONNECTION_GENERAL
+  kDebug() << "Received" << job->getWireSize() << "bytes, decoded to" << job->getDecodedSize()
+           << "bytes (" << reply->rawHeader( "Content-Encoding" ) << ") - total for" << request->getAction()
+           << ":" << sizes.wireBytes << "of" << sizes.decodedBytes << "bytes.";
+#endif
 
 #ifdef KMESS_NETWORK_WINDOW
     KMESS_NET_RECEIVED( this, replyContents );
@@ -483,6 +972,16 @@ void HttpSoapConnection::slotRequestFinished( QNetworkReply *reply )
 
   // Check for errors
   bool success = currentResponse->isValid();
+
+  // Forget the redirection to a host which fails, the next requests will go to the original host
+  if( ! success )
+  {
+    const QString originalHost( QUrl( request->getEndPoint() ).host() );
+    if( reply->url().host() != originalHost )
+    {
+      SoapRedirectionCache::instance()->invalidate( originalHost );
+    }
+  }
   if( success )
   {
 #ifdef KMESSDEBUG_HTTPSOAPCONNECTION_GENERAL
@@ -509,12 +1008,14 @@ void HttpSoapConnection::slotRequestFinished( QNetworkReply *reply )
         {
           redirectionCounts_[ originalHost ] = 0;
         }
-        redirections_[ originalHost ] = redirectHost;
+        SoapRedirectionCache::instance()->addRedirection( originalHost, redirectHost );
         redirectionCounts_[ originalHost ] = redirectionCounts_[ originalHost ] + 1;
 
         // Limit the number of redirects from the original host
         if( redirectionCounts_[ originalHost ] > 5 )
         {
+          requestFailed( request );
+
           emit soapError( i18nc( "Error message", "Too many redirections by web service" ),
                           MsnSocketBase::ERROR_SOAP_TOOMANYREDIRECTS );
         }
@@ -523,7 +1024,7 @@ void HttpSoapConnection::slotRequestFinished( QNetworkReply *reply )
           // Retry sending the message by sending an identical one immediately.
           // We've mapped the old endpoint to the new one so there's no need to change the message
           // endpoint. Also, we copy it because this method deletes the current message.
-          SoapMessage *messageCopy = new SoapMessage( *currentRequest_ );
+          SoapMessage *messageCopy = new SoapMessage( *request );
           requests_.prepend( messageCopy );
         }
       }
@@ -539,15 +1040,20 @@ void HttpSoapConnection::slotRequestFinished( QNetworkReply *reply )
       QString preferredHostName( XmlFunctions::getNodeValue( currentResponse->getHeader(),
                                                              "ServiceHeader/PreferredHostName" ) );
 
-      // Verify if the server is suggesting us to use another server
-      if( ! preferredHostName.isEmpty() && ! redirections_.contains( originalHost ) )
+      const QString currentTarget( SoapRedirectionCache::instance()->getTarget( originalHost ) );
+
+      // Verify if the server is suggesting us to use another server; the same suggestion again extends it
+      if( ! preferredHostName.isEmpty() && ( currentTarget.isEmpty() || currentTarget == preferredHostName ) )
       {
+        if( currentTarget.isEmpty() )
+        {
 #ifdef KMESSDEBUG_HTTPSOAPCONNECTION_GENERAL
-        kDebug() << "Received hostname suggestion from:" << originalUrl << "to:" << preferredHostName;
+          kDebug() << "Received hostname suggestion from:" << originalUrl << "to:" << preferredHostName;
 #endif
+          redirectionCounts_[ originalHost ] = 0;
+        }
 
-        redirectionCounts_[ originalHost ] = 0;
-        redirections_[ originalHost ] = preferredHostName;
+        SoapRedirectionCache::instance()->addRedirection( originalHost, preferredHostName );
       }
 
       // Then parse this response
@@ -556,6 +1062,8 @@ void HttpSoapConnection::slotRequestFinished( QNetworkReply *reply )
   }
   else if( statusCode == 503 )
   {
+    requestFailed( request );
+
     if( metaObject()->className() == QString( "OfflineImService" ) )
     {
       emit soapWarning( i18nc( "Warning message",
@@ -574,8 +1082,9 @@ void HttpSoapConnection::slotRequestFinished( QNetworkReply *reply )
     // Display at the console for logging
     kWarning() << "Received an unknown" << statusCode << "status code (" << error
                << ") while connecting to endpoint" << reply->url();
-    kWarning() << "Reply contents:";
-    kWarning() << replyContents;
+    kWarning() << "Reply parsing result:" << currentResponse->getFaultDescription();
+
+    requestFailed( request );
 
     // Inform listeners that the request failed
     emit soapError( i18nc( "Error message with description (system-generated description)",
@@ -590,23 +1099,31 @@ void HttpSoapConnection::slotRequestFinished( QNetworkReply *reply )
   reply->deleteLater();
 
   // Reset all internal data
-  delete currentRequest_;
-  delete currentResponse;
   currentRequest_ = 0;
-  isSending_ = false;
+  delete request;
+  delete currentResponse;
 
 #ifdef KMESSDEBUG_HTTPSOAPCONNECTION_GENERAL
   kDebug() << "Completed response handling from endpoint" << replyUrl << ", with success?" << requestSuccess;
 #endif
 
-  // Send the next queued message
-#if QT_VERSION > 0x040500
-  // Work around a Qt-4.5.1-devel bug which doesn't clean up correctly after each request.
-  QTimer::singleShot( 250, this, SLOT(sendNextRequest()));
-#else
-  sendNextRequest();
+#ifdef KMESSDEBUG_HTTPSOAPCONNECTION_GENERAL
+  if( requests_.isEmpty() && pendingRequests_.isEmpty() )
+  {
+    kDebug() << "Queue drained:" << queueSentCount_ << "requests handled in" << queueTime_.elapsed() << "ms.";
+  }
 #endif
-  return;
+
+  // Send the next queued messages right away; the reply has been released already
+  if( hasRequestCleanupBug() )
+  {
+    // Work around a Qt-4.5.1-devel bug which doesn't clean up correctly after each request.
+    QTimer::singleShot( SOAPCONNECTION_BUGGY_QT_REQUEST_DELAY, this, SLOT(sendNextRequest()) );
+  }
+  else
+  {
+    sendNextRequest();
+  }
 }
 
 
@@ -616,6 +1133,50 @@ void HttpSoapConnection::slotRequestFinished( QNetworkReply *reply )
  */
 void HttpSoapConnection::slotRequestTimeout()
 {
+  QTimer        *responseTimer = qobject_cast<QTimer*>( sender() );
+  QNetworkReply *reply         = replyTimers_.key( responseTimer );
+
+  // The request was completed or aborted in the meanwhile
+  if( reply == 0 || ! pendingRequests_.contains( reply ) )
+  {
+    return;
+  }
+
+  SoapMessage *request = pendingRequests_.take( reply );
+
+  kWarning() << "No response from" << reply->url() << "after" << responseTimer->interval() << "ms, aborting the request.";
+
+  // The target of a redirection may be down, the original host will redirect again if needed
+  const QString originalHost( QUrl( request->getEndPoint() ).host() );
+  if( reply->url().host() != originalHost )
+  {
+    SoapRedirectionCache::instance()->invalidate( originalHost );
+  }
+
+  // Cancel the stuck request, so it doesn't hold up the queue anymore
+  releaseReply( reply );
+
+  // Send the request again, if it's safe to do so
+  const int retryCount = retryCounts_.value( request );
+  if( request->isIdempotent() && retryCount < SOAPCONNECTION_MAX_RETRIES )
+  {
+#ifdef KMESSDEBUG_HTTPSOAPCONNECTION_GENERAL
+    kDebug() << "Sending the request again:" << request->getAction();
+#endif
+
+    retryCounts_.insert( request, retryCount + 1 );
+    requests_.prepend( request );
+    sendNextRequest();
+    return;
+  }
+
+  retryCounts_.remove( request );
+  requestFailed( request );
+  delete request;
+
+  // Let the other requests go on
+  sendNextRequest();
+
   // Inform listeners that the request failed
   emit soapError( i18nc( "Error message",
                          "No response from web service" ),
@@ -627,8 +1188,10 @@ void HttpSoapConnection::slotRequestTimeout()
 /**
  * @brief Called when an ssl error occurred while setting up the connection.
  */
-void HttpSoapConnection::slotSslErrors( QNetworkReply *reply, const QList<QSslError> &sslErrors )
+void HttpSoapConnection::slotSslErrors( const QList<QSslError> &sslErrors )
 {
+  QNetworkReply *reply = qobject_cast<QNetworkReply*>( sender() );
+
   foreach( QSslError error, sslErrors )
   {
     kWarning() << "Got SSL error" << error.errorString() << "while connecting to endpoint" << reply->url();
@@ -641,12 +1204,14 @@ void HttpSoapConnection::slotSslErrors( QNetworkReply *reply, const QList<QSslEr
 
 
 /**
- * @brief Decode UTF-8 text from a SOAP node (usually friendly names).
+ * @brief Decode the text of a SOAP node (usually friendly names).
+ *
+ * The responses are parsed from their raw bytes, so the UTF-8 text is already
+ * decoded: only the HTML entities are left.
  */
 QString HttpSoapConnection::textNodeDecode( const QString &string )
 {
-  QString copy( QString::fromUtf8( string.toLatin1() ) );
-  return KMessShared::htmlUnescape( copy );
+  return KMessShared::htmlUnescape( string );
 }
 
 
@@ -20,20 +20,24 @@
 
 #include "../msnsocketbase.h"
 
+#include <QByteArray>
 #include <QDomElement>
 #include <QHash>
 #include <QList>
-#include <QMutex>
+#include <QNetworkRequest>
+#include <QSet>
+#include <QSharedPointer>
+#include <QTime>
 #include <QTimer>
 #include <QUrl>
 
 
 class QAuthenticator;
-class QNetworkAccessManager;
 class QNetworkReply;
 class QSslError;
 
 class SoapMessage;
+class SoapParseJob;
 class MimeMessage;
 
 
@@ -61,6 +65,19 @@ class MimeMessage;
  * A request can be sent with sendRequest(). The response is received as SoapMessage in parseSoapResult():
  * overwrite parseSoapResult() to handle the normal responses, and parseSoapFault() for the error responses.
  *
+ * Up to getMaximumConcurrentRequests() requests which read data are sent at the same time; requests
+ * which change data are sent alone, in order. Further requests wait in the queue. Each response is matched to the request it belongs to, so getCurrentRequest() always
+ * returns the request of the response which is being parsed.
+ *
+ * Each request has its own timeout, derived from the recent latencies of its action. A request
+ * which times out is aborted; if it only reads data, it's sent again once before failing.
+ *
+ * Responses are parsed incrementally while their data arrives, by a SoapParseJob running in a
+ * worker thread. parseSoapResult() and parseSoapFault() are still called in the thread which
+ * owns the connection.
+ *
+ * The HTTP connections themselves are shared by all services, through the SoapTransport.
+ *
  * @author Diederik van der Boor
  * @author Valerio Pilo
  * @ingroup NetworkSoap
@@ -77,53 +94,118 @@ class HttpSoapConnection : public QObject
 
     // Abort all queued requests
     void                 abort();
+    // Return the maximum number of requests which can be sent at the same time
+    int                  getMaximumConcurrentRequests() const;
     // Whether the connection is idle, not processing a SOAP request/response
     bool                 isIdle();
+    // Change the maximum number of requests which can be sent at the same time
+    void                 setMaximumConcurrentRequests( int maximum );
 
   protected:
     // Return the current request message, if any
     SoapMessage         *getCurrentRequest( bool copy = false ) const;
     // Parse the SOAP fault
     virtual void         parseSoapFault( SoapMessage *message );
+    // Open a connection to an endpoint in advance
+    void                 preconnect( const QString &endpointAddress );
     // The connection received the full response
     virtual void         parseSoapResult( SoapMessage *message ) = 0;
+    // A request failed without a SOAP response
+    virtual void         requestFailed( SoapMessage *request );
+    // Send a SOAP request whose response doesn't matter
+    void                 sendDetachedRequest( SoapMessage *message );
     // Send a SOAP request to the webservice
     virtual void         sendRequest( SoapMessage *message, bool urgent = false );
-    // Decode UTF-8 text from a SOAP node (usually friendly names).
+    // Decode the text of a SOAP node (usually friendly names).
     QString              textNodeDecode( const QString &string );
 
+  private:  // private structures
+    // Amount of data received for a SOAP action
+    struct ResponseSizes
+    {
+      // Bytes received from the network
+      qint64             wireBytes;
+      // Bytes after decompression
+      qint64             decodedBytes;
+
+      ResponseSizes() : wireBytes( 0 ), decodedBytes( 0 ) {}
+    };
+
+  private:  // private methods
+    // Stop parsing the replies
+    void                 cancelParseJobs();
+    // Return whether a request which changes data is waiting for its response
+    bool                 hasPendingChange() const;
+    // Stop the processing of a reply, and release it
+    void                 releaseReply( QNetworkReply *reply );
+    // Create a HTTP request to an endpoint
+    QNetworkRequest      createNetworkRequest( const QString &endpointAddress ) const;
+
+  private:  // private static methods
+    // Return the key of a request in the latency statistics
+    static QString       getLatencyKey( const SoapMessage *message );
+    // Return how long to wait for the response to a request
+    static int           getResponseTimeout( const SoapMessage *message );
+    // Return whether the running Qt library needs a delay between requests
+    static bool          hasRequestCleanupBug();
+    // Remember how long it took to receive a response
+    static void          recordLatency( const SoapMessage *message, int latency );
+    // Set the headers which describe the contents of a request
+    static bool          setContentsHeaders( QNetworkRequest &request, const QString &soapAction, int size );
+
   private slots:
     // Send the next request in queue to the endpoint.
     void                 sendNextRequest();
     // Called when the remote server requires authentication
     void                 slotAuthenticationRequired( QNetworkReply *reply, QAuthenticator *authenticator );
+    // Called when a reply has received a new chunk of data
+    void                 slotReplyReadyRead();
     // Called when the request to the remote server finished
-    void                 slotRequestFinished( QNetworkReply *reply );
+    void                 slotRequestFinished();
+    // Called when the response to a request has been parsed
+    void                 slotResponseParsed();
     // Called when a timeout occurred while sending a request
     void                 slotRequestTimeout();
     // Called when an ssl error occurred while setting up the connection
-    void                 slotSslErrors( QNetworkReply *reply, const QList<QSslError> &sslErrors );
+    void                 slotSslErrors( const QList<QSslError> &sslErrors );
 
 
   private:  // private attributes
-    /// The current request which is being processed
+    /// The request whose response is being processed
     SoapMessage         *currentRequest_;
-    /// The list of redirections
-    QHash<QString,QString> redirections_;
+    /// The maximum number of requests which can be sent at the same time
+    int                  maxConcurrentRequests_;
+    /// The requests which have been sent, indexed by their reply
+    QHash<QNetworkReply*,SoapMessage*> pendingRequests_;
+    /// The replies which have been completely received, and are being parsed
+    QSet<QNetworkReply*> receivedReplies_;
+    /// Raw contents of the replies which are being received, only kept for debugging
+    QHash<QNetworkReply*,QByteArray> replyDumps_;
+    /// The jobs which parse the replies
+    QHash<QNetworkReply*,QSharedPointer<SoapParseJob> > replyJobs_;
+    /// Time since each request has been sent, by reply
+    QHash<QNetworkReply*,QTime> replySentTimes_;
+    /// The timers which detect the stuck requests, by reply
+    QHash<QNetworkReply*,QTimer*> replyTimers_;
+    /// Number of times each request has been sent again
+    QHash<SoapMessage*,int> retryCounts_;
     /// The redirection counter for each redirection
     QHash<QString,int> redirectionCounts_;
     /// The queue of active requests
     QList<SoapMessage*>  requests_;
-    /// The connection manager
-    QNetworkAccessManager *http_;
-    /// Whether a message is being sent or not
-    bool                 isSending_;
-	QMutex               lockMutex_;
-    /// Timer used to detect timeouts when sending requests
-    QTimer               responseTimer_;
+    /// Amount of data received for each SOAP action
+    QHash<QString,ResponseSizes> responseSizes_;
+    /// Number of requests sent since the queue was last empty
+    int                  queueSentCount_;
+    /// Time since the queue was last empty
+    QTime                queueTime_;
     /// The last SOAP action
     QString              soapAction_;
 
+  private:  // private static attributes
+    /// Latencies of the recent responses, by action
+    static QHash<QString,QList<int> > latencies_;
+
   signals:
     /**
      * @brief Fired when a fatal error occured.
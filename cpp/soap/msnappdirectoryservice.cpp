@@ -21,6 +21,7 @@
 #include "../../kmessdebug.h"
 #include "httpsoapconnection.h"
 #include "soapmessage.h"
+#include "soapstreamparser.h"
 
 
 #ifdef KMESSDEBUG_APPDIRECTORYSERVICE
@@ -35,6 +36,85 @@
 
 
 
+/**
+ * @brief Streaming parser for the application directory listings.
+ *
+ * It runs in the SOAP parsing thread, and converts the data set to plain entries.
+ */
+class MsnAppDirectoryParser : public SoapElementHandler
+{
+  public:
+    // Return a new parser, without any results
+    SoapElementHandler *createEmpty() const
+    {
+      return new MsnAppDirectoryParser();
+    }
+
+    // Return the local names of the body elements to extract
+    QStringList getElementNames() const
+    {
+      return QStringList() << "NewDataSet";
+    }
+
+    // Process the data set
+    void parseElement( const QDomElement &dataSet );
+
+  public:
+    /// The entries found in the data set
+    QList<MsnAppDirectoryService::Entry> entries;
+};
+
+
+
+// Process the data set
+void MsnAppDirectoryParser::parseElement( const QDomElement &dataSet )
+{
+  const QDomNodeList entryNodes( dataSet.childNodes() );
+
+  for( int i = 0; i < entryNodes.count(); i++ )
+  {
+    QDomNode entryProperties( entryNodes.item( i ) );
+
+    // Fill the values
+    MsnAppDirectoryService::Entry entry;
+    entry.entryId         = XmlFunctions::getNodeValue( entryProperties, "EntryID"         ).toInt();
+    entry.subscriptionUrl = XmlFunctions::getNodeValue( entryProperties, "SubscriptionURL" );
+    entry.error           = XmlFunctions::getNodeValue( entryProperties, "Error"           );
+    entry.locale          = XmlFunctions::getNodeValue( entryProperties, "Locale"          );
+    entry.sequence        = XmlFunctions::getNodeValue( entryProperties, "Sequence"        );
+    entry.name            = XmlFunctions::getNodeValue( entryProperties, "Name"            );
+    entry.description     = XmlFunctions::getNodeValue( entryProperties, "Description"     );
+    entry.url             = XmlFunctions::getNodeValue( entryProperties, "URL"             );
+    entry.iconUrl         = XmlFunctions::getNodeValue( entryProperties, "IconURL"         );
+    entry.appIconUrl      = XmlFunctions::getNodeValue( entryProperties, "AppIconURL"      );
+    entry.type            = XmlFunctions::getNodeValue( entryProperties, "Type"            );
+    entry.location        = XmlFunctions::getNodeValue( entryProperties, "Location"        );
+    entry.clientVersion   = XmlFunctions::getNodeValue( entryProperties, "ClientVersion"   );
+    entry.page            = XmlFunctions::getNodeValue( entryProperties, "Page"            ).toInt();
+    entry.categoryId      = XmlFunctions::getNodeValue( entryProperties, "CategoryID"      ).toInt();
+    entry.passportSiteId  = XmlFunctions::getNodeValue( entryProperties, "PassportSiteID"  ).toInt();
+    entry.height          = XmlFunctions::getNodeValue( entryProperties, "Height"          ).toInt();
+    entry.width           = XmlFunctions::getNodeValue( entryProperties, "Width"           ).toInt();
+    entry.minUsers        = XmlFunctions::getNodeValue( entryProperties, "MinUsers"        ).toInt();
+    entry.maxUsers        = XmlFunctions::getNodeValue( entryProperties, "MaxUsers"        ).toInt();
+    entry.maxPacketRate   = XmlFunctions::getNodeValue( entryProperties, "MaxPacketRate"   ).toInt();
+    entry.appType         = XmlFunctions::getNodeValue( entryProperties, "AppType"         ).toInt();
+    entry.kids            = XmlFunctions::getNodeValue( entryProperties, "Kids"            ) == "1";
+    entry.enableIp        = XmlFunctions::getNodeValue( entryProperties, "EnableIP"        ) == "True";
+    entry.activeX         = XmlFunctions::getNodeValue( entryProperties, "ActiveX"         ) == "True";
+    entry.sendFile        = XmlFunctions::getNodeValue( entryProperties, "SendFile"        ) == "True";
+    entry.receiveIM       = XmlFunctions::getNodeValue( entryProperties, "ReceiveIM"       ) == "True";
+    entry.replaceIM       = XmlFunctions::getNodeValue( entryProperties, "ReplaceIM"       ) == "True";
+    entry.windows         = XmlFunctions::getNodeValue( entryProperties, "Windows"         ) == "True";
+    entry.userProperties  = XmlFunctions::getNodeValue( entryProperties, "UserProperties"  ) == "True";
+    entry.hidden          = XmlFunctions::getNodeValue( entryProperties, "Hidden"          ) == "True";
+
+    entries.append( entry );
+  }
+}
+
+
+
 // Constructor
 MsnAppDirectoryService::MsnAppDirectoryService( QObject *parent )
   : HttpSoapConnection( parent )
@@ -91,61 +171,28 @@ void MsnAppDirectoryService::parseSoapResult( SoapMessage *message )
   kDebug() << "Got query response";
 #endif
 
-  // Parse the list of result entries
-  QDomNode     dataSet( XmlFunctions::getNode( message->getBody(), "diffgram/NewDataSet" ) );
-  QDomNodeList entries( dataSet.childNodes() );
-
-  for( int i = 0; i < entries.count(); i++ )
+  // The entries have been parsed already, in the SOAP parsing thread
+  const MsnAppDirectoryParser *parser = dynamic_cast<const MsnAppDirectoryParser*>( message->getElementHandler() );
+  if( parser == 0 )
   {
-    QDomNode entryProperties( entries.item( i ) );
+    kWarning() << "Application directory response received without its parser!";
+    return;
+  }
 
-    int entryId = XmlFunctions::getNodeValue( entryProperties, "EntryID" ).toInt();
-    if( getEntryById( entryId ) != 0 )
+  foreach( const Entry &entry, parser->entries )
+  {
+    if( getEntryById( entry.entryId ) != 0 )
     {
       // Ignore entries that are already present
       continue;
     }
 
-    // Fill the values
-    Entry *entry = new Entry;
-    entry->entryId         = entryId;
-    entry->subscriptionUrl = XmlFunctions::getNodeValue( entryProperties, "SubscriptionURL" );
-    entry->error           = XmlFunctions::getNodeValue( entryProperties, "Error"           );
-    entry->locale          = XmlFunctions::getNodeValue( entryProperties, "Locale"          );
-    entry->sequence        = XmlFunctions::getNodeValue( entryProperties, "Sequence"        );
-    entry->name            = XmlFunctions::getNodeValue( entryProperties, "Name"            );
-    entry->description     = XmlFunctions::getNodeValue( entryProperties, "Description"     );
-    entry->url             = XmlFunctions::getNodeValue( entryProperties, "URL"             );
-    entry->iconUrl         = XmlFunctions::getNodeValue( entryProperties, "IconURL"         );
-    entry->appIconUrl      = XmlFunctions::getNodeValue( entryProperties, "AppIconURL"      );
-    entry->type            = XmlFunctions::getNodeValue( entryProperties, "Type"            );
-    entry->location        = XmlFunctions::getNodeValue( entryProperties, "Location"        );
-    entry->clientVersion   = XmlFunctions::getNodeValue( entryProperties, "ClientVersion"   );
-    entry->page            = XmlFunctions::getNodeValue( entryProperties, "Page"            ).toInt();
-    entry->categoryId      = XmlFunctions::getNodeValue( entryProperties, "CategoryID"      ).toInt();
-    entry->passportSiteId  = XmlFunctions::getNodeValue( entryProperties, "PassportSiteID"  ).toInt();
-    entry->height          = XmlFunctions::getNodeValue( entryProperties, "Height"          ).toInt();
-    entry->width           = XmlFunctions::getNodeValue( entryProperties, "Width"           ).toInt();
-    entry->minUsers        = XmlFunctions::getNodeValue( entryProperties, "MinUsers"        ).toInt();
-    entry->maxUsers        = XmlFunctions::getNodeValue( entryProperties, "MaxUsers"        ).toInt();
-    entry->maxPacketRate   = XmlFunctions::getNodeValue( entryProperties, "MaxPacketRate"   ).toInt();
-    entry->appType         = XmlFunctions::getNodeValue( entryProperties, "AppType"         ).toInt();
-    entry->kids            = XmlFunctions::getNodeValue( entryProperties, "Kids"            ) == "1";
-    entry->enableIp        = XmlFunctions::getNodeValue( entryProperties, "EnableIP"        ) == "True";
-    entry->activeX         = XmlFunctions::getNodeValue( entryProperties, "ActiveX"         ) == "True";
-    entry->sendFile        = XmlFunctions::getNodeValue( entryProperties, "SendFile"        ) == "True";
-    entry->receiveIM       = XmlFunctions::getNodeValue( entryProperties, "ReceiveIM"       ) == "True";
-    entry->replaceIM       = XmlFunctions::getNodeValue( entryProperties, "ReplaceIM"       ) == "True";
-    entry->windows         = XmlFunctions::getNodeValue( entryProperties, "Windows"         ) == "True";
-    entry->userProperties  = XmlFunctions::getNodeValue( entryProperties, "UserProperties"  ) == "True";
-    entry->hidden          = XmlFunctions::getNodeValue( entryProperties, "Hidden"          ) == "True";
-
 #ifdef KMESSDEBUG_APPDIRECTORYSERVICE_GENERAL
-    kDebug() << "Received entry " << entry->name << ".";
+    kDebug() << "Received entry " << entry.name << ".";
 #endif
 
     // Add to the list
-    entries_.append( entry );
+    entries_.append( new Entry( entry ) );
   }
 
 #ifdef KMESSDEBUG_APPDIRECTORYSERVICE_GENERAL
@@ -171,10 +218,13 @@ void MsnAppDirectoryService::queryServiceList( MsnAppDirectoryServiceType type )
                 "  <AppType>0</AppType>\n"
                 "</GetFilteredDataSet2>" );
 
-  sendRequest( new SoapMessage( SERVICE_URL_APPDIRSERVICE,
-                                "http://www.msn.com/webservices/Messenger/Client/GetFilteredDataSet2",
-                                QString(),
-                                body ) );
+  SoapMessage *message = new SoapMessage( SERVICE_URL_APPDIRSERVICE,
+                                          "http://www.msn.com/webservices/Messenger/Client/GetFilteredDataSet2",
+                                          QString(),
+                                          body );
+  message->setElementHandler( new MsnAppDirectoryParser() );
+
+  sendRequest( message );
 }
 
 
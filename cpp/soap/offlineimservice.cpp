@@ -48,6 +48,16 @@
  */
 #define SERVICE_URL_OUTGOING_OFFLINE_IM_SERVICE  "https://ows.messenger.msn.com/OimWS/oim.asmx"
 
+/**
+ * @brief Milliseconds to wait for more messages to delete, before sending the deletion request
+ */
+#define OFFLINEIM_DELETE_DELAY                   2000
+
+/**
+ * @brief Number of messages to delete which is sent right away, without waiting for more
+ */
+#define OFFLINEIM_DELETE_MAX_MESSAGES            100
+
 
 
 
@@ -74,6 +84,10 @@ OfflineImService::OfflineImService( const QString &authT, const QString &authP,
 
   setObjectName( "OfflineImService[receiver]" );
 
+  deleteTimer_.setSingleShot( true );
+  connect( &deleteTimer_, SIGNAL(          timeout() ),
+           this,          SLOT  ( flushDeletions() ) );
+
   // Initialize the header once. The tokens are escaped after getting copied (mid(0) returns a copy)
   passportCookieHeader_ =
       "    <PassportCookie xmlns=\"http://www.hotmail.msn.com/ws/2004/09/oim/rsi\">\n"
@@ -100,6 +114,10 @@ OfflineImService::OfflineImService( QObject *parent )
 #endif
 
   setObjectName( "OfflineImService[sender]" );
+
+  deleteTimer_.setSingleShot( true );
+  connect( &deleteTimer_, SIGNAL(          timeout() ),
+           this,          SLOT  ( flushDeletions() ) );
 }
 
 
@@ -109,6 +127,16 @@ OfflineImService::OfflineImService( QObject *parent )
  */
 OfflineImService::~OfflineImService()
 {
+  // Delete the collected messages now, or they would be received again at the next login
+  if( ! pendingDeletions_.isEmpty() )
+  {
+#ifdef KMESSDEBUG_OFFLINE_IM_GENERAL
+    kDebug() << "requesting deletion of messages before closing:" << pendingDeletions_;
+#endif
+
+    sendDetachedRequest( createDeleteRequest( pendingDeletions_ ) );
+  }
+
 #ifdef KMESSDEBUG_OFFLINE_IM_GENERAL
   kDebug() << "DESTROYED.";
 #endif
@@ -116,29 +144,87 @@ OfflineImService::~OfflineImService()
 
 
 
+/**
+ * @brief  Internal function to create the request which deletes messages from the remote storage.
+ *
+ * @param  messageIds  List of messages to delete.
+ * @return The DeleteMessages request.
+ */
+SoapMessage *OfflineImService::createDeleteRequest( const QStringList &messageIds ) const
+{
+  QString body( "    <DeleteMessages xmlns=\"http://www.hotmail.msn.com/ws/2004/09/oim/rsi\">\n"
+                "      <messageIds>\n"
+                "        <messageId>" + messageIds.join("</messageId>\n        <messageId>") + "</messageId>\n"
+                "      </messageIds>\n"
+                "    </DeleteMessages>" );
+
+  return new SoapMessage( SERVICE_URL_INCOMING_OFFLINE_IM_SERVICE,
+                          "http://www.hotmail.msn.com/ws/2004/09/oim/rsi/DeleteMessages",
+                          passportCookieHeader_,
+                          body );
+}
+
+
+
 /**
  * @brief  SOAP call to delete messages from the remote storage.
+ *
+ * The messages are usually deleted one by one, as soon as each one is received. Instead of
+ * sending a request for each one, the messages are collected for OFFLINEIM_DELETE_DELAY
+ * milliseconds, or until OFFLINEIM_DELETE_MAX_MESSAGES are waiting, and deleted with a
+ * single request. Use flushDeletions() to send the request right away; the messages which
+ * are still waiting when the service is destroyed are deleted at that point.
+ *
  * @param  messageIds  List of messages to delete.
  */
 void OfflineImService::deleteMessages( const QStringList &messageIds )
 {
-#ifdef KMESSDEBUG_OFFLINE_IM_GENERAL
-  kDebug() << "requesting deletion of messages:" << messageIds;
-#endif
 #ifdef KMESSTEST
   KMESS_ASSERT( ! messageIds.isEmpty() );
 #endif
 
-  QString body( "    <DeleteMessages xmlns=\"http://www.hotmail.msn.com/ws/2004/09/oim/rsi\">\n"
-                "      <messageIds>\n"
-                "        <messageId>" + messageIds.join("</messageId>\n        <messageId>") + "</messageId>\n"
-                "      </messageIds>\n"
-                "    </DeleteMessages>" );
+  foreach( const QString &messageId, messageIds )
+  {
+    if( ! pendingDeletions_.contains( messageId ) )
+    {
+      pendingDeletions_.append( messageId );
+    }
+  }
+
+  if( pendingDeletions_.count() >= OFFLINEIM_DELETE_MAX_MESSAGES )
+  {
+    flushDeletions();
+  }
+  else if( ! deleteTimer_.isActive() )
+  {
+    deleteTimer_.start( OFFLINEIM_DELETE_DELAY );
+  }
+}
+
+
 
-  sendSecureRequest( new SoapMessage( SERVICE_URL_INCOMING_OFFLINE_IM_SERVICE,
-                                      "http://www.hotmail.msn.com/ws/2004/09/oim/rsi/DeleteMessages",
-                                      passportCookieHeader_,
-                                      body ) );
+/**
+ * @brief  Send the request to delete the collected messages.
+ *
+ * Does nothing if there are no messages waiting to be deleted.
+ */
+void OfflineImService::flushDeletions()
+{
+  deleteTimer_.stop();
+
+  if( pendingDeletions_.isEmpty() )
+  {
+    return;
+  }
+
+  const QStringList messageIds( pendingDeletions_ );
+  pendingDeletions_.clear();
+
+#ifdef KMESSDEBUG_OFFLINE_IM_GENERAL
+  kDebug() << "requesting deletion of messages:" << messageIds;
+#endif
+
+  sendSecureRequest( createDeleteRequest( messageIds ) );
 }
 
 
@@ -228,11 +314,17 @@ void OfflineImService::getMetaData()
   MessageData data;
   data.type = "GetMetaData";
 
+  static const SoapRequestTemplate requestTemplate( "%{*passportCookie}",
+      "<GetMetadata xmlns=\"http://www.hotmail.msn.com/ws/2004/09/oim/rsi\" />" );
+
+  SoapRequestValues values;
+  values.insert( "passportCookie", passportCookieHeader_ );
+
   // Send the request.
   sendRequest( new SoapMessage( SERVICE_URL_INCOMING_OFFLINE_IM_SERVICE,
                                 "http://www.hotmail.msn.com/ws/2004/09/oim/rsi/GetMetadata",
-                                passportCookieHeader_,
-                                "<GetMetadata xmlns=\"http://www.hotmail.msn.com/ws/2004/09/oim/rsi\" />",
+                                requestTemplate,
+                                values,
                                 data ) );
 }
 
@@ -558,7 +650,7 @@ void OfflineImService::storeMessage( const QString &to, const QString &message,
                   "<Ticket xmlns=\"http://messenger.msn.com/ws/2004/09/oim/\"\n"
                   " appid=\"" + handler.getProductId() + "\""
                   " lockkey=\"" + offlineImKey + "\""
-                  " passport=\"\" />" // This attribute is filled by the base class
+                  " passport=\"" SOAP_TOKEN_PLACEHOLDER "\" />" // This attribute is filled by the base class
                   "<Sequence xmlns=\"http://schemas.xmlsoap.org/ws/2003/03/rm\">\n"
                   "  <Identifier xmlns=\"http://schemas.xmlsoap.org/ws/2002/07/utility\">http://messenger.msn.com</Identifier>\n"
                   "  <MessageNumber>" + QString::number( sequenceNum ) + "</MessageNumber>\n"
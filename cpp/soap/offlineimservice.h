@@ -21,6 +21,8 @@
 #include "passportloginservice.h"
 
 #include <QHash>
+#include <QStringList>
+#include <QTimer>
 
 
 class ChatMessage;
@@ -68,7 +70,13 @@ class OfflineImService : public PassportLoginService
     // Send an offline message
     void                 sendMessage( const QString &to, const QString &message );
 
+  public slots:
+    // Send the request to delete the collected messages
+    void                 flushDeletions();
+
   private:
+    // Create the request which deletes messages from the storage space
+    SoapMessage         *createDeleteRequest( const QStringList &messageIds ) const;
     // Extract the email address from an RFC822 formatted string.
     QString              extractRFC822Address( const QString &address );
     // Process the SOAP fault returned when sending an offline message.
@@ -85,12 +93,16 @@ class OfflineImService : public PassportLoginService
     QString              authT_;
     /// The <code>p</code> value of the passport cookie.
     QString              authP_;
+    // Timer to send the collected message deletions
+    QTimer               deleteTimer_;
     // Offline message sequence number
     int                  nextSequenceNum_;
     /// The passport header to send with SOAP
     QString              passportCookieHeader_;
     // The passport service for require the new ticket
     PassportLoginService *passportService_;
+    // The messages waiting to be deleted
+    QStringList          pendingDeletions_;
     // GuID for the OIM session
     QString              runID_;
 
@@ -21,6 +21,8 @@
 #include "../../utils/xmlfunctions.h"
 #include "../../currentaccount.h"
 #include "../mimemessage.h"
+#include "passporttokenbroker.h"
+#include "passporttokencache.h"
 #include "soapmessage.h"
 
 #include <QUrl>
@@ -34,6 +36,65 @@
  */
 #define SERVICE_URL_RST_SERVICE  "https://login.live.com/RST.srf"
 
+/**
+ * @brief How many seconds before their expiration the used tokens are renewed
+ */
+#define TOKEN_REFRESH_MARGIN         300
+
+/**
+ * @brief Maximum number of read requests waiting for each token
+ *
+ * All the requests wait in the same queue, in order; only the ones which need
+ * the same token count towards its limit. Changes are never dropped: they can't
+ * be asked again like the reads.
+ */
+#define TOKEN_QUEUE_MAXIMUM_SIZE     100
+
+/**
+ * @brief How many seconds before their expiration the tokens are not used anymore
+ */
+#define TOKEN_EXPIRATION_MARGIN      10
+
+/**
+ * @brief Minimum delay in seconds between two background token renewals
+ */
+#define TOKEN_REFRESH_MINIMUM_DELAY  30
+
+/**
+ * @brief How many seconds the saved tokens must still be valid to be reused
+ */
+#define TOKEN_SAVED_MINIMUM_VALIDITY 60
+
+
+/**
+ * @brief A token which can be requested to the RST service
+ */
+struct TokenScope
+{
+  /// Name of the token, as used by the secure requests and CurrentAccount
+  const char *name;
+  /// Address of the service the token applies to
+  const char *address;
+  /// The policy to request, empty to use the login parameters
+  const char *policy;
+};
+
+/**
+ * @brief The tokens which can be requested, in the order they're requested
+ *
+ * The Passport token is always requested, the RST service refuses requests without it.
+ */
+static const TokenScope tokenScopes[] =
+{
+  { "Passport",        "http://Passport.NET/tb",   0         },
+  { "MessengerClear",  "messengerclear.live.com",  ""        }, // Authentication for messenger
+  { "Messenger",       "messenger.msn.com",        "?id=507" }, // Messenger website authentication
+  { "Contacts",        "contacts.msn.com",         "MBI"     }, // Contact server
+  { "MessengerSecure", "messengersecure.live.com", "MBI_SSL" }, // Messenger live, to send offline messages
+  { "Storage",         "storage.msn.com",          "MBI"     }, // Storage site, for the roaming service
+};
+
+
 
 // Static attributes initialization
 QHash<QString,QDateTime> PassportLoginService::tokenExpirationDates_;
@@ -55,12 +116,31 @@ QHash<QString,QDateTime> PassportLoginService::tokenExpirationDates_;
 PassportLoginService::PassportLoginService( QObject *parent )
 : HttpSoapConnection( parent )
 , currentAccount_( CurrentAccount::instance() )
+, isRefreshingTokens_( false )
+, isWaitingForLogin_( false )
 , isWaitingForNewTokens_( false )
+, maximumQueueWait_( 0 )
+, replayedRequestsCount_( 0 )
+, totalQueueWait_( 0 )
 {
   // RST stands for "Request Security Token"
   // This class is called "PassportLoginService" since "RequestSecurityTokenService" is too hard to understand.
 
   setObjectName( "PassportLoginService" );
+
+  tokenRefreshTimer_.setSingleShot( true );
+  connect( &tokenRefreshTimer_, SIGNAL(          timeout() ),
+            this,               SLOT  ( slotRefreshTokens() ) );
+
+  // Use the tokens renewed by the other services
+  connect( PassportTokenBroker::instance(), SIGNAL(     tokensChanged() ),
+           this,                            SLOT  ( slotTokensChanged() ) );
+  connect( PassportTokenBroker::instance(), SIGNAL(     tokensChanged() ),
+           this,                            SLOT  (   slotResumeLogin() ) );
+  connect( PassportTokenBroker::instance(), SIGNAL(     renewalFailed() ),
+           this,                            SLOT  ( slotRenewalFailed() ) );
+  connect( PassportTokenBroker::instance(), SIGNAL(     renewalFailed() ),
+           this,                            SLOT  (   slotResumeLogin() ) );
 }
 
 
@@ -70,7 +150,10 @@ PassportLoginService::PassportLoginService( QObject *parent )
  */
 PassportLoginService::~PassportLoginService()
 {
-  qDeleteAll( queuedRequests_.keys() );
+  foreach( const QueuedRequest &request, queuedRequests_ )
+  {
+    delete request.message;
+  }
 }
 
 
@@ -81,6 +164,9 @@ PassportLoginService::~PassportLoginService()
  * The loginSucceeded() signal is fired when the webservice accepted the login data.
  * The loginIncorrect() signal is fired when the login data is incorrect.
  *
+ * If another service is renewing the tokens, the login waits for its tokens instead of
+ * sending a second RST request.
+ *
  * @param  parameters  The login parameters found in the <code>USR</code> command of notification server.
  */
 void PassportLoginService::login( const QString &parameters )
@@ -89,9 +175,132 @@ void PassportLoginService::login( const QString &parameters )
   kDebug() << "Logging in...";
 #endif
 
-  // Store the account and login data
+  // Store the login data
   authenticationParameters_ = parameters;
-  handle_                   = currentAccount_->getHandle();
+  isRefreshingTokens_       = false;
+
+  // Another service is renewing the tokens: wait for them
+  if( ! PassportTokenBroker::instance()->requestTokens( this, getTokenScopeNames() ) )
+  {
+    isWaitingForLogin_ = true;
+    return;
+  }
+
+  isWaitingForLogin_ = false;
+
+  requestTokens( getTokenScopeNames() );
+}
+
+
+
+/**
+ * @brief Renew only some of the tokens
+ *
+ * Only the given scopes are requested to the RST service, and the received tokens
+ * replace the old ones: the other tokens stay valid, and the requests using them are
+ * not affected. The loginSucceeded() signal is not fired.
+ *
+ * @param  tokenNames      The names of the tokens to renew, like "Contacts" or "Storage".
+ * @param  useSavedTokens  Whether the saved tokens can be used, if they're newer than the current ones.
+ */
+void PassportLoginService::refreshTokens( const QStringList &tokenNames, bool useSavedTokens )
+{
+#ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
+  kDebug() << "Renewing tokens:" << tokenNames;
+#endif
+
+  // Another service may be renewing the tokens already
+  if( ! PassportTokenBroker::instance()->requestTokens( this, tokenNames ) )
+  {
+    return;
+  }
+
+  isRefreshingTokens_ = true;
+
+  requestTokens( tokenNames, useSavedTokens );
+}
+
+
+
+/**
+ * @brief Return the names of all the token scopes
+ */
+QStringList PassportLoginService::getTokenScopeNames()
+{
+  QStringList names;
+
+  for( uint index = 0; index < sizeof( tokenScopes ) / sizeof( TokenScope ); ++index )
+  {
+    names.append( tokenScopes[ index ].name );
+  }
+
+  return names;
+}
+
+
+
+/**
+ * @brief A request failed without a SOAP response
+ *
+ * When the RST request fails, like on a timeout or a server error, no response
+ * tells the other services that the renewal is over: the broker is told here.
+ *
+ * @param  request  The request which failed.
+ */
+void PassportLoginService::requestFailed( SoapMessage *request )
+{
+  inProgressRequests_.remove( request );
+
+  if( request->getEndPoint() != SERVICE_URL_RST_SERVICE )
+  {
+    return;
+  }
+
+#ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
+  kDebug() << "The token request failed.";
+#endif
+
+  isRefreshingTokens_    = false;
+  isWaitingForNewTokens_ = false;
+  PassportTokenBroker::instance()->tokensFailed( this );
+}
+
+
+
+/**
+ * @brief Request the given tokens, or use the saved ones if they're valid
+ *
+ * @param  tokenNames      The names of the tokens to obtain.
+ * @param  useSavedTokens  Whether the saved tokens can be used.
+ */
+void PassportLoginService::requestTokens( const QStringList &tokenNames, bool useSavedTokens )
+{
+  loadCredentials();
+
+  // Reuse the tokens of a previous session, or the ones renewed by another service
+  if( useSavedTokens && loadSavedTokens( tokenNames ) )
+  {
+    return;
+  }
+
+  // Only services which really ask for tokens need a connection to the RST service
+  preconnect( SERVICE_URL_RST_SERVICE );
+
+  // Send the login request
+  requestMultipleSecurityTokens( tokenNames );
+}
+
+
+
+/**
+ * @brief Read the credentials of the current account
+ *
+ * They're needed to request tokens, and to decrypt and encrypt the saved ones.
+ */
+void PassportLoginService::loadCredentials()
+{
+  // Store the account data
+  handle_ = currentAccount_->getHandle();
 
   // Get the right password
   if( password_.isEmpty() )
@@ -112,9 +321,81 @@ void PassportLoginService::login( const QString &parameters )
   KMESS_ASSERT( ! handle_  .isEmpty() );
   KMESS_ASSERT( ! password_.isEmpty() );
 #endif
+}
 
-  // Send the login request
-  requestMultipleSecurityTokens();
+
+
+/**
+ * @brief Use the tokens saved by a previous session, if they're still valid
+ *
+ * The saved tokens may also be newer than the current ones, when another
+ * service has renewed them. Only the given tokens, and their proofs, replace
+ * the current ones: the others may be newer than the saved ones.
+ *
+ * @param  tokenNames  The names of the tokens which must be valid.
+ * @return Whether the saved tokens have been used.
+ */
+bool PassportLoginService::loadSavedTokens( const QStringList &tokenNames )
+{
+  QHash<QString,QString>   tokens;
+  QHash<QString,QDateTime> expirationDates;
+
+  if( ! PassportTokenCache::load( handle_, password_, tokens, expirationDates ) || tokens.isEmpty() )
+  {
+    return false;
+  }
+
+  const QDateTime now( QDateTime::currentDateTime() );
+
+  foreach( const QString &tokenName, tokenNames )
+  {
+    const QDateTime expiration( expirationDates.value( tokenName ) );
+
+    // Background renewals need tokens newer than the current ones
+    if( ! expiration.isValid()
+    ||  now.secsTo( expiration ) < TOKEN_SAVED_MINIMUM_VALIDITY
+    ||  ( isRefreshingTokens_ && tokenExpirationDates_.value( tokenName ).isValid()
+                              && expiration <= tokenExpirationDates_.value( tokenName ) ) )
+    {
+#ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
+      kDebug() << "The saved token" << tokenName << "is not usable, logging in.";
+#endif
+      return false;
+    }
+  }
+
+#ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
+  kDebug() << "Using" << tokenNames.count() << "saved security tokens:" << tokenNames;
+#endif
+
+  QHash<QString,QString> currentTokens( getCurrentTokens() );
+  foreach( const QString &tokenName, tokenNames )
+  {
+    tokenExpirationDates_.insert( tokenName, expirationDates.value( tokenName ) );
+    currentTokens.insert( tokenName, tokens.value( tokenName ) );
+
+    const QString proofName( tokenName + "Proof" );
+    if( tokens.contains( proofName ) )
+    {
+      currentTokens.insert( proofName, tokens.value( proofName ) );
+    }
+  }
+
+  currentAccount_->setTokens( currentTokens );
+
+  isWaitingForNewTokens_ = false;
+
+  // Send the waiting requests of all services
+  PassportTokenBroker::instance()->tokensReceived( this );
+
+  // Like after a real login, the signal is not emitted from within login()
+  if( ! isRefreshingTokens_ )
+  {
+    QMetaObject::invokeMethod( this, "loginSucceeded", Qt::QueuedConnection );
+  }
+
+  isRefreshingTokens_ = false;
+  return true;
 }
 
 
@@ -297,16 +578,39 @@ void PassportLoginService::parseSoapFault( SoapMessage *message )
     kDebug() << "Authentication failed!";
 #endif
 
+    // The saved tokens belong to the wrong credentials
+    PassportTokenCache::clear( handle_ );
+
+    isWaitingForNewTokens_ = false;
+    PassportTokenBroker::instance()->tokensFailed( this );
+
     emit loginIncorrect();
   }
   // The tickets have expired, require new ones
   else if( faultCode == "q0:BadContextToken" )
   {
-    login();
+    const QString tokenName( inProgressRequests_.value( getCurrentRequest() ) );
 
-    // Resend the failed message
-    SoapMessage *messageCopy = getCurrentRequest( true /* copy */ );
-    sendSecureRequest( messageCopy, inProgressRequests_.value( getCurrentRequest() ) );
+    // The request is unknown, like a copy sent again after a redirection:
+    // asking for an unnamed token would never succeed
+    if( tokenName.isEmpty() )
+    {
+      kWarning() << "Rejected token for an unknown request" << message->getAction();
+
+      parseSecureFault( message );
+    }
+    else
+    {
+      // The server doesn't accept it anymore, the saved one is the same
+      loadCredentials();
+      tokenExpirationDates_.remove( tokenName );
+      PassportTokenCache::remove( handle_, password_, tokenName );
+      refreshTokens( QStringList() << tokenName, false );
+
+      // Resend the failed message
+      SoapMessage *messageCopy = getCurrentRequest( true /* copy */ );
+      sendSecureRequest( messageCopy, tokenName );
+    }
   }
   else
   {
@@ -443,6 +747,9 @@ void PassportLoginService::parseSoapResult( SoapMessage *message )
   const QDomNodeList authTokens( body.childNodes() );
   if( authTokens.count() == 0 )
   {
+    isWaitingForNewTokens_ = false;
+    PassportTokenBroker::instance()->tokensFailed( this );
+
     // Likely a login error.
     emit loginIncorrect();
     return;
@@ -453,9 +760,10 @@ void PassportLoginService::parseSoapResult( SoapMessage *message )
   kDebug() << "Current date and time:" << now;
 #endif
 
+  // Start from the current tokens: only the requested ones are replaced
+  QHash<QString,QString> tokens( getCurrentTokens() );
+
   // Set the token and proof for hotmail live services (mail, spaces etc..)
-  QHash<QString,QString> tokens;
-  tokenExpirationDates_.clear();
   for( uint index = 0; index < authTokens.length(); ++index )
   {
     const QDomNode tokenResponse( authTokens.item( index ) );
@@ -565,20 +873,21 @@ void PassportLoginService::parseSoapResult( SoapMessage *message )
 
   // Save the tokens
   currentAccount_->setTokens( tokens );
+  PassportTokenCache::save( handle_, password_, tokens, tokenExpirationDates_ );
+
+  const bool wasRefreshingTokens = isRefreshingTokens_;
 
+  isRefreshingTokens_    = false;
   isWaitingForNewTokens_ = false;
 
-  // Send any message which was waiting for a new token
-  QHashIterator<SoapMessage*,QString> it( queuedRequests_ );
-  while( it.hasNext() )
+  // Send the waiting requests of all services
+  PassportTokenBroker::instance()->tokensReceived( this );
+
+  // Background renewals are transparent
+  if( wasRefreshingTokens )
   {
-    it.next();
-    sendSecureRequest( it.key(), it.value() );
+    return;
   }
-#ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
-  kDebug() << "Sent" << queuedRequests_.count() << "queued messages.";
-#endif
-
 
   emit loginSucceeded();
 }
@@ -588,7 +897,8 @@ void PassportLoginService::parseSoapResult( SoapMessage *message )
 /**
  * @brief SOAP call to request the login tokens.
  *
- * This method is called by login().
+ * This method is called by login() and refreshTokens(), and only
+ * requests the given tokens; the Passport token is always included.
  * It sends a huge binary blob which looks like this:
  * @code
 <?xml version="1.0" encoding="utf-8"?>
@@ -641,10 +951,10 @@ void PassportLoginService::parseSoapResult( SoapMessage *message )
 </soap:Envelope>
 @endcode
  */
-void PassportLoginService::requestMultipleSecurityTokens()
+void PassportLoginService::requestMultipleSecurityTokens( const QStringList &tokenNames )
 {
 #ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
-  kDebug() << "Requesting security tokens";
+  kDebug() << "Requesting security tokens:" << tokenNames;
 #endif
 
   const QString authParams( KMessShared::htmlEscape( QUrl::fromPercentEncoding( authenticationParameters_.toUtf8() )
@@ -673,77 +983,37 @@ void PassportLoginService::requestMultipleSecurityTokens()
                 " xmlns:wsp=\"http://schemas.xmlsoap.org/ws/2002/12/policy\""
                 " xmlns:wsa=\"http://schemas.xmlsoap.org/ws/2004/03/addressing\""
                 " xmlns:wsse=\"http://schemas.xmlsoap.org/ws/2003/06/secext\""
-                " Id=\"RSTS\">\n"
-
-                // Unknown, but it's required for the request to succeed
-                "  <wst:RequestSecurityToken Id=\"RST0\">\n"
-                "    <wst:RequestType>http://schemas.xmlsoap.org/ws/2004/04/security/trust/Issue</wst:RequestType>\n"
-                "    <wsp:AppliesTo>\n"
-                "      <wsa:EndpointReference>\n"
-                "        <wsa:Address>http://Passport.NET/tb</wsa:Address>\n"
-                "      </wsa:EndpointReference>\n"
-                "    </wsp:AppliesTo>\n"
-                "  </wst:RequestSecurityToken>\n"
-
-                // Authentication for messenger
-                "  <wst:RequestSecurityToken Id=\"RST1\">\n"
-                "    <wst:RequestType>http://schemas.xmlsoap.org/ws/2004/04/security/trust/Issue</wst:RequestType>\n"
-                "    <wsp:AppliesTo>\n"
-                "      <wsa:EndpointReference>\n"
-                "        <wsa:Address>messengerclear.live.com</wsa:Address>\n"
-                "      </wsa:EndpointReference>\n"
-                "    </wsp:AppliesTo>\n"
-                "    <wsse:PolicyReference URI=\"" + authParams + "\"></wsse:PolicyReference>\n"
-                "  </wst:RequestSecurityToken>\n"
-
-                // Messenger website authentication
-                "  <wst:RequestSecurityToken Id=\"RST2\">\n"
+                " Id=\"RSTS\">\n" );
 
-                "    <wst:RequestType>http://schemas.xmlsoap.org/ws/2004/04/security/trust/Issue</wst:RequestType>\n"
-                "    <wsp:AppliesTo>\n"
-                "      <wsa:EndpointReference>\n"
-                "        <wsa:Address>messenger.msn.com</wsa:Address>\n"
-                "      </wsa:EndpointReference>\n"
-                "    </wsp:AppliesTo>\n"
-
-                "    <wsse:PolicyReference URI=\"?id=507\"></wsse:PolicyReference>\n"
+  int requestId = 0;
+  for( uint index = 0; index < sizeof( tokenScopes ) / sizeof( TokenScope ); ++index )
+  {
+    const TokenScope &scope = tokenScopes[ index ];
 
-                "  </wst:RequestSecurityToken>\n"
+    // The first token is required for the request to succeed
+    if( index > 0 && ! tokenNames.contains( scope.name ) )
+    {
+      continue;
+    }
 
-                // Authentication for the Contact server
-                "  <wst:RequestSecurityToken Id=\"RST3\">\n"
+    body +=     "  <wst:RequestSecurityToken Id=\"RST" + QString::number( requestId++ ) + "\">\n"
                 "    <wst:RequestType>http://schemas.xmlsoap.org/ws/2004/04/security/trust/Issue</wst:RequestType>\n"
                 "    <wsp:AppliesTo>\n"
                 "      <wsa:EndpointReference>\n"
-                "        <wsa:Address>contacts.msn.com</wsa:Address>\n"
+                "        <wsa:Address>" + QString( scope.address ) + "</wsa:Address>\n"
                 "      </wsa:EndpointReference>\n"
-                "    </wsp:AppliesTo>\n"
-                "    <wsse:PolicyReference URI=\"MBI\"></wsse:PolicyReference>\n"
-                "  </wst:RequestSecurityToken>\n"
+                "    </wsp:AppliesTo>\n";
 
-                // Authentication for the messenger live ( example: to send offline messages )
-                "  <wst:RequestSecurityToken Id=\"RST4\">\n"
-                "    <wst:RequestType>http://schemas.xmlsoap.org/ws/2004/04/security/trust/Issue</wst:RequestType>\n"
-                "    <wsp:AppliesTo>\n"
-                "      <wsa:EndpointReference>\n"
-                "        <wsa:Address>messengersecure.live.com</wsa:Address>\n"
-                "      </wsa:EndpointReference>\n"
-                "    </wsp:AppliesTo>\n"
-                "    <wsse:PolicyReference URI=\"MBI_SSL\"></wsse:PolicyReference>\n"
-                "  </wst:RequestSecurityToken>\n"
+    if( scope.policy != 0 )
+    {
+      const QString policy( *scope.policy ? QString( scope.policy ) : authParams );
+      body +=   "    <wsse:PolicyReference URI=\"" + policy + "\"></wsse:PolicyReference>\n";
+    }
 
-                // Authentication for the storage msn site ( for roaming service )
-                "  <wst:RequestSecurityToken Id=\"RST5\">\n"
-                "  <wst:RequestType>http://schemas.xmlsoap.org/ws/2004/04/security/trust/Issue</wst:RequestType>\n"
-                "    <wsp:AppliesTo>\n"
-                "      <wsa:EndpointReference>\n"
-                "        <wsa:Address>storage.msn.com</wsa:Address>\n"
-                "      </wsa:EndpointReference>\n"
-                "    </wsp:AppliesTo>\n"
-                "    <wsse:PolicyReference URI=\"MBI\"></wsse:PolicyReference>\n"
-                "  </wst:RequestSecurityToken>\n"
+    body +=     "  </wst:RequestSecurityToken>\n";
+  }
 
-                "</ps:RequestMultipleSecurityTokens>" );
+  body +=       "</ps:RequestMultipleSecurityTokens>";
 
   isWaitingForNewTokens_ = true;
 
@@ -756,137 +1026,350 @@ void PassportLoginService::requestMultipleSecurityTokens()
 
 
 /**
- * @brief Send the authenticated SOAP request from a subclass
- * @internal
+ * @brief Return the tokens of the current account, with their proofs
  *
- * This method sends authenticated SOAP messages. It first needs to verify
- * if the session's ticket tokens are still valid - and if not, request new
- * ones then sends the request.
- *
- * @param message  The SOAP response message.
+ * @return The token values, by token name. Missing tokens are not included.
  */
-void PassportLoginService::sendSecureRequest( SoapMessage *message, const QString &requiredTokenName )
+QHash<QString,QString> PassportLoginService::getCurrentTokens() const
 {
-  // Send requests without authentication
-  if( requiredTokenName.isEmpty() )
+  QHash<QString,QString> tokens;
+
+  foreach( const QString &tokenName, getTokenScopeNames() << "PassportProof" << "MessengerClearProof" )
   {
-    sendRequest( message );
-    return;
+    const QString value( currentAccount_->getToken( tokenName ) );
+    if( ! value.isEmpty() )
+    {
+      tokens.insert( tokenName, value );
+    }
   }
 
-#ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
-  kDebug() << "Sending secure request with token:" << requiredTokenName;
-#endif
+  return tokens;
+}
+
+
+
+/**
+ * @brief Return whether a token can be used
+ *
+ * Tokens which are about to expire are considered expired already.
+ */
+bool PassportLoginService::hasValidToken( const QString &tokenName ) const
+{
+  const QDateTime tokenExpiration( tokenExpirationDates_.value( tokenName ) );
+
+  return ! currentAccount_->getToken( tokenName ).isEmpty()
+      && tokenExpiration.isValid()
+      && QDateTime::currentDateTime().secsTo( tokenExpiration ) >= TOKEN_EXPIRATION_MARGIN;
+}
 
-  const QString tokenValue( currentAccount_->getToken( requiredTokenName ) );
-  const QDateTime &tokenExpiration = tokenExpirationDates_[ requiredTokenName ];
 
-  int timeDifference = QDateTime::currentDateTime().secsTo( tokenExpiration );
 
+/**
+ * @brief Send the requests which were waiting for new tokens
+ *
+ * The requests are sent in the order they were made, whatever token they need, so
+ * operations which depend on each other are not reordered. The replay stops at the
+ * first request whose token is still not valid: it and the following requests keep
+ * waiting, and the missing tokens are requested.
+ */
+void PassportLoginService::sendQueuedRequests()
+{
 #ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
-  kDebug() << "Token has a value?" << (!tokenValue.isEmpty());
-  kDebug() << "Current time:" << QDateTime::currentDateTime();
-  kDebug() << "Token expires on:" << tokenExpiration << ", that is within seconds:" << timeDifference;
+  const int previousReplayedCount = replayedRequestsCount_;
 #endif
 
-  // If there is no value for this token, or the token is about to expire, ask a new one
-  if( tokenValue.isEmpty() || timeDifference < 10 )
+  while( ! queuedRequests_.isEmpty() && hasValidToken( queuedRequests_.first().tokenName ) )
   {
+    const QueuedRequest request( queuedRequests_.takeFirst() );
+    const int wait = request.queueTime.elapsed();
+
+    maximumQueueWait_ = qMax( maximumQueueWait_, wait );
+    totalQueueWait_  += wait;
+    ++replayedRequestsCount_;
+
+    sendAuthenticatedRequest( request.message, request.tokenName );
+  }
+
 #ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
-    kDebug() << "Token is expired or invalid.";
+  if( replayedRequestsCount_ > previousReplayedCount )
+  {
+    kDebug() << "Sent" << ( replayedRequestsCount_ - previousReplayedCount ) << "requests waiting for tokens,"
+             << queuedRequests_.count() << "still waiting.";
+    kDebug() << "Requests waited" << ( totalQueueWait_ / replayedRequestsCount_ ) << "ms on average, at most"
+             << maximumQueueWait_ << "ms, over" << replayedRequestsCount_ << "requests.";
+  }
 #endif
 
-    // Queue the message
-    if( ! queuedRequests_.contains( message ) )
+  QStringList missingTokenNames;
+  foreach( const QueuedRequest &request, queuedRequests_ )
+  {
+    if( ! missingTokenNames.contains( request.tokenName ) && ! hasValidToken( request.tokenName ) )
     {
-      queuedRequests_.insert( message, requiredTokenName );
+      missingTokenNames.append( request.tokenName );
     }
+  }
 
-    // We're already waiting for new tokens
-    if( isWaitingForNewTokens_ )
+  if( ! missingTokenNames.isEmpty() && ! isWaitingForNewTokens_ )
+  {
+    refreshTokens( missingTokenNames );
+  }
+}
+
+
+
+/**
+ * @brief Start the timer to renew the used tokens before they expire
+ *
+ * The timer is set to TOKEN_REFRESH_MARGIN seconds before the first of the tokens
+ * used by this service expires. Tokens this service never used are not considered.
+ */
+void PassportLoginService::scheduleTokenRefresh()
+{
+  QDateTime firstExpiration;
+
+  foreach( const QString &tokenName, usedTokenNames_ )
+  {
+    const QDateTime expiration( tokenExpirationDates_.value( tokenName ) );
+
+    if( expiration.isValid() && ( ! firstExpiration.isValid() || expiration < firstExpiration ) )
     {
-#ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
-      kDebug() << "Already requesting new tokens.";
-#endif
-      return;
+      firstExpiration = expiration;
     }
+  }
+
+  if( ! firstExpiration.isValid() )
+  {
+    tokenRefreshTimer_.stop();
+    return;
+  }
+
+  const int delay = qMax( QDateTime::currentDateTime().secsTo( firstExpiration ) - TOKEN_REFRESH_MARGIN,
+                          TOKEN_REFRESH_MINIMUM_DELAY );
 
 #ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
-    kDebug() << "Asking for new tokens.";
+  kDebug() << "Renewing the tokens in" << delay << "seconds.";
 #endif
 
-    // Ask for new tokens, altogether instead of just one at a time,
-    // for convenience and bandwidth saving
-    login();
+  tokenRefreshTimer_.start( delay * 1000 );
+}
+
+
+
+/**
+ * @brief Renew the tokens in the background
+ *
+ * The current tokens are still valid: secure requests keep using them
+ * while the new ones are requested.
+ */
+void PassportLoginService::slotRefreshTokens()
+{
+  if( isWaitingForNewTokens_ )
+  {
     return;
   }
 
 #ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
-  kDebug() << "Token is valid, adding it to the request.";
+  kDebug() << "Renewing the tokens before they expire.";
 #endif
 
-  // Insert the token value within the SOAP message header
-  QDomNodeList list;
-  QDomElement header( message->getHeader().toElement() );
+  refreshTokens( usedTokenNames_.toList() );
+}
 
-  list = header.elementsByTagName( "TicketToken" );
 
-  // There is no <TicketToken> tag: search for the <Ticket> tag
-  if( list.isEmpty() )
+
+/**
+ * @brief Give up the requests waiting for a renewal which failed
+ *
+ * The first waiting request always needs a token which is not valid, and the
+ * others can't be sent before it without reordering the changes: all of them
+ * are dropped. Asking for the tokens again would only fail the same way.
+ */
+void PassportLoginService::slotRenewalFailed()
+{
+  // This service is still waiting for its own request
+  if( isWaitingForNewTokens_ || queuedRequests_.isEmpty() )
   {
-    list = header.elementsByTagName( "Ticket" );
+    return;
   }
 
-  // None of the ticket token tags were found, send the message as is
-  if( list.isEmpty() )
+  kWarning() << "The tokens could not be renewed, dropping" << queuedRequests_.count() << "waiting requests.";
+
+  foreach( const QueuedRequest &request, queuedRequests_ )
   {
-    kWarning() << "Token tag not found! Sending the request as is.";
+#ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
+    kDebug() << "Dropping request" << request.message->getAction() << "waiting for the token" << request.tokenName;
+#endif
+    delete request.message;
+  }
+  queuedRequests_.clear();
+
+  emit soapWarning( i18nc( "Warning message",
+                           "The connection to the Live Messenger servers could not be renewed; "
+                           "some changes were not sent to the server." ),
+                    true );
+}
+
+
+
+/**
+ * @brief Continue a login which waited for the renewal of another service
+ *
+ * The renewed tokens are saved, so the login will likely use them without sending a request.
+ * If the renewal failed, the login sends its own request, and reports the result.
+ */
+void PassportLoginService::slotResumeLogin()
+{
+  if( ! isWaitingForLogin_ )
+  {
+    return;
+  }
+
+  login( authenticationParameters_ );
+}
+
 
+
+/**
+ * @brief Use new tokens, obtained by this or another service
+ */
+void PassportLoginService::slotTokensChanged()
+{
+  scheduleTokenRefresh();
+  sendQueuedRequests();
+}
+
+
+
+/**
+ * @brief Send the authenticated SOAP request from a subclass
+ * @internal
+ *
+ * This method sends authenticated SOAP messages. It first needs to verify
+ * if the session's ticket tokens are still valid - and if not, request new
+ * ones then sends the request.
+ *
+ * @param message  The SOAP response message.
+ */
+void PassportLoginService::sendSecureRequest( SoapMessage *message, const QString &requiredTokenName )
+{
+  // Send requests without authentication
+  if( requiredTokenName.isEmpty() )
+  {
     sendRequest( message );
     return;
   }
 
-  for( uint index = 0; index < list.length(); ++index )
+#ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
+  kDebug() << "Sending secure request with token:" << requiredTokenName;
+#endif
+
+  // Keep the tokens used by this service fresh
+  if( ! usedTokenNames_.contains( requiredTokenName ) )
   {
-    QDomElement item( list.item( index ).toElement() );
+    usedTokenNames_.insert( requiredTokenName );
 
-    // <TicketToken> tags directly contain the token value
-    if( item.tagName() == "TicketToken" )
+    if( ! isWaitingForNewTokens_ )
     {
+      scheduleTokenRefresh();
+    }
+  }
+
+#ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
+  kDebug() << "Token has a value?" << (!currentAccount_->getToken( requiredTokenName ).isEmpty());
+  kDebug() << "Current time:" << QDateTime::currentDateTime();
+  kDebug() << "Token expires on:" << tokenExpirationDates_.value( requiredTokenName );
+#endif
+
+  // If there is no value for this token, or the token is about to expire, ask a new one.
+  // If other requests are waiting, wait behind them, to keep the requests in order.
+  if( ! hasValidToken( requiredTokenName ) || ! queuedRequests_.isEmpty() )
+  {
 #ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
-      kDebug() << "TicketToken tag found!";
+    kDebug() << "Token is expired or invalid, or other requests are waiting.";
 #endif
 
-      // If there is a child text node, simply replace its text
-      if( item.firstChild().nodeType() == QDomNode::TextNode )
+    // Limit the reads waiting for the token
+    if( message->isIdempotent() )
+    {
+      int waitingCount = 0;
+      foreach( const QueuedRequest &queuedRequest, queuedRequests_ )
       {
-        item.firstChild().toText().setNodeValue( tokenValue );
+        if( queuedRequest.tokenName == requiredTokenName && queuedRequest.message->isIdempotent() )
+        {
+          ++waitingCount;
+        }
       }
-      else
+
+      if( waitingCount >= TOKEN_QUEUE_MAXIMUM_SIZE )
       {
-        QDomText text( item.ownerDocument().createTextNode( tokenValue ) );
-        item.appendChild( text );
+        kWarning() << "Too many requests waiting for the token" << requiredTokenName
+                   << ", dropping the request" << message->getAction() << "(" << message->getData().type << ").";
+
+        delete message;
+
+        emit soapWarning( i18nc( "Warning message",
+                                 "Too many requests are waiting to be sent to the server; some of them were lost." ),
+                          false );
+        return;
       }
-      break;
     }
 
-    // <Ticket> tags contain the token value within the "passport" attribute
-    if( item.tagName() == "Ticket" )
+    // Queue the message after the others
+    QueuedRequest request;
+    request.message   = message;
+    request.tokenName = requiredTokenName;
+    request.queueTime.start();
+    queuedRequests_.append( request );
+
+    // We're already waiting for new tokens
+    if( isWaitingForNewTokens_ )
     {
 #ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
-      kDebug() << "Ticket tag found!";
+      kDebug() << "Already requesting new tokens.";
 #endif
-      item.setAttribute( "passport", tokenValue );
-      break;
+      return;
     }
+
+#ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
+    kDebug() << "Sending the waiting requests, or asking for new tokens.";
+#endif
+
+    // Send what can be sent, and ask for the expired tokens only, the others are still good
+    sendQueuedRequests();
+    return;
   }
 
-  // Remove the message from the queue (if it was there) and add it to the in progress messages
-  if( queuedRequests_.contains( message ) )
+  sendAuthenticatedRequest( message, requiredTokenName );
+}
+
+
+
+/**
+ * @brief Add the token to a request, and send it
+ *
+ * @param  message    The request, whose token is valid.
+ * @param  tokenName  The name of the token the request needs.
+ */
+void PassportLoginService::sendAuthenticatedRequest( SoapMessage *message, const QString &tokenName )
+{
+#ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
+  kDebug() << "Token is valid, adding it to the request.";
+#endif
+
+  // None of the ticket token placeholders were found, send the message as is
+  if( ! message->hasTokenPlaceholder() )
   {
-    queuedRequests_.remove( message );
+    kWarning() << "Token placeholder not found! Sending the request as is.";
+
+    sendRequest( message );
+    return;
   }
-  inProgressRequests_.insert( message, requiredTokenName );
+
+  // The token is written in place of the placeholder when the message is sent
+  message->setToken( currentAccount_->getToken( tokenName ) );
+
+  // Add the message to the in progress messages
+  inProgressRequests_.insert( message, tokenName );
 
 #ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
   kDebug() << "Sending authenticated request.";
@@ -22,6 +22,10 @@
 #include "../../kmessdebug.h"
 
 #include <QDateTime>
+#include <QSet>
+#include <QStringList>
+#include <QTime>
+#include <QTimer>
 
 
 // Forward declarations
@@ -58,6 +62,19 @@ class SoapMessage;
  * with a valid non-expired token, and will automatically send
  * token update requests when they expire.
  *
+ * Tokens used by the secure requests are renewed in the background
+ * some minutes before they expire, so requests normally don't have
+ * to wait for the authentication service. The tokens are also saved,
+ * encrypted, with PassportTokenCache: the next session reuses them
+ * if they are still valid, without logging in again.
+ *
+ * All the instances share the same tokens: renewals and logins go
+ * through the PassportTokenBroker, so when a token expires only one
+ * instance asks for it, and the others use the result.
+ *
+ * Secure requests which wait for a token are kept in a single queue,
+ * and sent in the order they were made, whatever token they need.
+ *
  *
  * This replaces the SSL-based Passport 1.4 login.
  * The old class used a simple HTTP header to send results,
@@ -83,9 +100,13 @@ class PassportLoginService : public HttpSoapConnection
     virtual             ~PassportLoginService();
     // Start the login process
     void                 login( const QString &parameters = QString() );
+    // Renew only some of the tokens
+    void                 refreshTokens( const QStringList &tokenNames, bool useSavedTokens = true );
     // Compute the string for live hotmail access
     static const QString createHotmailToken( const QString &passportToken, const QString &proofToken,
                                              const QString &folder );
+    // Return the names of all the token scopes
+    static QStringList   getTokenScopeNames();
 
   protected: // Protected members
     // Bounce the authenticated SOAP fault to a subclass
@@ -95,13 +116,53 @@ class PassportLoginService : public HttpSoapConnection
     // Send the authenticated SOAP request from a subclass
     void                 sendSecureRequest( SoapMessage *message, const QString &requiredTokenName = QString() );
 
+  private: // Private structures
+    /// A request waiting for a token
+    struct QueuedRequest
+    {
+      /// The request
+      SoapMessage       *message;
+      /// Time since the request was queued
+      QTime              queueTime;
+      /// The name of the token the request needs
+      QString            tokenName;
+    };
+
   private:
+    // Return the tokens of the current account, with their proofs
+    QHash<QString,QString> getCurrentTokens() const;
+    // Return whether a token can be used
+    bool                 hasValidToken( const QString &tokenName ) const;
+    // Read the credentials of the current account
+    void                 loadCredentials();
+    // Use the tokens saved by a previous session, if they're still valid
+    bool                 loadSavedTokens( const QStringList &tokenNames );
     // Parse the SOAP fault
     void                 parseSoapFault( SoapMessage *message );
     // Process server responses
     void                 parseSoapResult( SoapMessage *message );
+    // A request failed without a SOAP response
+    void                 requestFailed( SoapMessage *request );
     // Send the authentication request
-    void                 requestMultipleSecurityTokens();
+    void                 requestMultipleSecurityTokens( const QStringList &tokenNames );
+    // Request the given tokens, or use the saved ones if they're valid
+    void                 requestTokens( const QStringList &tokenNames, bool useSavedTokens = true );
+    // Start the timer to renew the used tokens before they expire
+    void                 scheduleTokenRefresh();
+    // Add the token to a request, and send it
+    void                 sendAuthenticatedRequest( SoapMessage *message, const QString &tokenName );
+    // Send the requests which were waiting for new tokens
+    void                 sendQueuedRequests();
+
+  private slots:
+    // Renew the tokens in the background
+    void                 slotRefreshTokens();
+    // Give up the requests waiting for a renewal which failed
+    void                 slotRenewalFailed();
+    // Continue a login which waited for the renewal of another service
+    void                 slotResumeLogin();
+    // Use new tokens, obtained by this or another service
+    void                 slotTokensChanged();
 
   protected: // Protected attributes
     // Current account instance
@@ -114,12 +175,26 @@ class PassportLoginService : public HttpSoapConnection
     QString              handle_;
     /// The user's password
     QString              password_;
+    /// Whether the tokens are being renewed in the background
+    bool                 isRefreshingTokens_;
+    /// Whether the login waits for the tokens being renewed by another service
+    bool                 isWaitingForLogin_;
     /// Whether we're waiting for new authentication tokens
     bool                 isWaitingForNewTokens_;
-    /// The queue of requests waiting new authentication tokens
-    QHash<SoapMessage*,QString>  queuedRequests_;
+    /// The requests waiting for new authentication tokens, in the order they were made
+    QList<QueuedRequest> queuedRequests_;
+    /// The longest time a request has waited for a token, in milliseconds
+    int                  maximumQueueWait_;
+    /// Number of requests sent after waiting for a token
+    int                  replayedRequestsCount_;
+    /// Total time the requests have waited for tokens, in milliseconds
+    int                  totalQueueWait_;
     /// The list of requests which are being sent
     QHash<SoapMessage*,QString>  inProgressRequests_;
+    /// Timer to renew the tokens before they expire
+    QTimer               tokenRefreshTimer_;
+    /// Names of the tokens used by the secure requests of this service
+    QSet<QString>        usedTokenNames_;
 
   private: // Private static attributes
     /// The expiration dates of the security tokens
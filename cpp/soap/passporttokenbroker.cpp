@@ -0,0 +1,194 @@
+/***************************************************************************
+                          passporttokenbroker.cpp
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "passporttokenbroker.h"
+
+#include "../../kmessdebug.h"
+#include "passportloginservice.h"
+
+
+#ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
+  #define KMESSDEBUG_PASSPORTTOKENBROKER
+#endif
+
+
+/**
+ * @brief Milliseconds after which a renewal without answer is abandoned
+ *
+ * It's longer than the timeout of the SOAP requests, so normally the requesting
+ * service reports the failure first. When it doesn't, renewalFailed() is fired.
+ */
+#define TOKEN_BROKER_REQUEST_TIMEOUT  120000
+
+
+
+// The constructor
+PassportTokenBroker::PassportTokenBroker()
+: QObject( 0 )
+, coalescedCount_( 0 )
+{
+  requestTimer_.setSingleShot( true );
+  requestTimer_.setInterval( TOKEN_BROKER_REQUEST_TIMEOUT );
+  connect( &requestTimer_, SIGNAL(            timeout() ),
+            this,          SLOT  ( slotRequestTimeout() ) );
+}
+
+
+
+// Return the instance of the broker
+PassportTokenBroker *PassportTokenBroker::instance()
+{
+  static PassportTokenBroker broker;
+  return &broker;
+}
+
+
+
+// Return whether a service is currently renewing tokens
+bool PassportTokenBroker::isRequesting() const
+{
+  return ! activeService_.isNull();
+}
+
+
+
+/**
+ * @brief Ask to renew some tokens
+ *
+ * If no other service is renewing tokens, the calling service becomes the one which
+ * sends the RST request. Otherwise it has to wait for tokensChanged().
+ *
+ * @param  service     The service which needs the tokens.
+ * @param  tokenNames  The names of the tokens it needs.
+ * @return Whether the service has to send the RST request itself.
+ */
+bool PassportTokenBroker::requestTokens( PassportLoginService *service, const QStringList &tokenNames )
+{
+  if( isRequesting() && activeService_ != service )
+  {
+    ++coalescedCount_;
+
+#ifdef KMESSDEBUG_PASSPORTTOKENBROKER
+    kDebug() << "Tokens" << tokenNames << "are waiting for the renewal of" << activeTokenNames_.toList()
+             << "-" << coalescedCount_ << "renewals avoided so far.";
+#endif
+    return false;
+  }
+
+  if( ! activeService_.isNull() )
+  {
+    disconnect( activeService_, SIGNAL( destroyed() ), this, SLOT( slotServiceDestroyed() ) );
+  }
+
+  activeService_    = service;
+  activeTokenNames_ = tokenNames.toSet();
+  requestTimer_.start();
+
+  connect( service, SIGNAL(            destroyed() ),
+           this,    SLOT  ( slotServiceDestroyed() ) );
+  return true;
+}
+
+
+
+// Forget the service which is renewing the tokens
+void PassportTokenBroker::resetActiveService()
+{
+  if( ! activeService_.isNull() )
+  {
+    disconnect( activeService_, SIGNAL( destroyed() ), this, SLOT( slotServiceDestroyed() ) );
+  }
+
+  activeService_ = 0;
+  activeTokenNames_.clear();
+  requestTimer_.stop();
+}
+
+
+
+/**
+ * @brief The renewal got no answer in time
+ *
+ * The service may still get its answer later: it then calls tokensReceived() as usual.
+ */
+void PassportTokenBroker::slotRequestTimeout()
+{
+  kWarning() << "No answer to the renewal of the tokens" << activeTokenNames_.toList()
+             << "after" << requestTimer_.interval() << "ms, giving up.";
+
+  resetActiveService();
+
+  emit renewalFailed();
+}
+
+
+
+// The service which was renewing the tokens has been deleted
+void PassportTokenBroker::slotServiceDestroyed()
+{
+  activeService_ = 0;
+  activeTokenNames_.clear();
+  requestTimer_.stop();
+
+  // Let the waiting services ask again
+  emit tokensChanged();
+}
+
+
+
+/**
+ * @brief Called when a service failed to renew the tokens
+ *
+ * The waiting requests are not sent again: they would only ask again with the same credentials,
+ * so the services drop them on renewalFailed(). The waiting logins are told the same way, so
+ * they can report the failure themselves.
+ *
+ * @param  service  The service which sent the RST request.
+ */
+void PassportTokenBroker::tokensFailed( PassportLoginService *service )
+{
+  if( activeService_ != service )
+  {
+    return;
+  }
+
+  resetActiveService();
+
+  emit renewalFailed();
+}
+
+
+
+/**
+ * @brief Called when a service has obtained new tokens
+ *
+ * The tokens may have been requested through the broker or not, like at login.
+ *
+ * @param  service  The service which obtained the tokens.
+ */
+void PassportTokenBroker::tokensReceived( PassportLoginService *service )
+{
+  if( activeService_ == service )
+  {
+    resetActiveService();
+  }
+
+  emit tokensChanged();
+}
+
+
+
+#include "passporttokenbroker.moc"
@@ -0,0 +1,105 @@
+/***************************************************************************
+                          passporttokenbroker.h
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef PASSPORTTOKENBROKER_H
+#define PASSPORTTOKENBROKER_H
+
+#include <QObject>
+#include <QPointer>
+#include <QSet>
+#include <QStringList>
+#include <QTimer>
+
+
+// Forward declarations
+class PassportLoginService;
+
+
+
+/**
+ * @brief Coordinates the token renewals of all the PassportLoginService instances.
+ *
+ * The tokens are shared by all the services of the process, but each service used to
+ * renew them on its own: when a token expired, every service using it sent its own
+ * request to the RST service.
+ *
+ * Before renewing tokens, a service asks the broker with requestTokens(). Only the first
+ * service gets to send the RST request; the others just wait. When new tokens are received,
+ * the service calls tokensReceived(), and the broker fires tokensChanged() to every service,
+ * so all of them can send the requests which were waiting. Services which still miss some
+ * tokens ask again, and their demands are coalesced into the next request.
+ *
+ * A renewal which gets no answer in time is abandoned, and reported with renewalFailed()
+ * like a failed one, so the waiting services don't wait forever.
+ *
+ * @ingroup NetworkSoap
+ */
+class PassportTokenBroker : public QObject
+{
+  Q_OBJECT
+
+  public:  // public static methods
+    // Return the instance of the broker
+    static PassportTokenBroker *instance();
+
+  public:  // public methods
+    // Return whether a service is currently renewing tokens
+    bool                 isRequesting() const;
+    // Ask to renew some tokens
+    bool                 requestTokens( PassportLoginService *service, const QStringList &tokenNames );
+    // Called when a service failed to renew the tokens
+    void                 tokensFailed( PassportLoginService *service );
+    // Called when a service has obtained new tokens
+    void                 tokensReceived( PassportLoginService *service );
+
+  private:  // private methods
+    // The constructor
+                         PassportTokenBroker();
+    // Forget the service which is renewing the tokens
+    void                 resetActiveService();
+
+  private slots:
+    // The renewal got no answer in time
+    void                 slotRequestTimeout();
+    // The service which was renewing the tokens has been deleted
+    void                 slotServiceDestroyed();
+
+  private:  // private properties
+    // The service which is renewing the tokens
+    QPointer<PassportLoginService> activeService_;
+    // The tokens being renewed
+    QSet<QString>        activeTokenNames_;
+    // Number of renewal demands which didn't need a new request
+    int                  coalescedCount_;
+    // Timer to abandon a renewal without answer
+    QTimer               requestTimer_;
+
+  signals:
+    /**
+     * @brief Fired when a renewal failed.
+     *
+     * Also fired when the renewal got no answer in time. The waiting logins try
+     * on their own, the waiting requests are abandoned.
+     */
+    void                 renewalFailed();
+
+    /**
+     * @brief Fired when new tokens are available.
+     */
+    void                 tokensChanged();
+};
+
+#endif
@@ -0,0 +1,261 @@
+/***************************************************************************
+                          passporttokencache.cpp
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "passporttokencache.h"
+
+#include "../../utils/kmessconfig.h"
+#include "../../utils/kmessshared.h"
+#include "../../kmessdebug.h"
+
+#include <QDataStream>
+#include <QFile>
+
+#include <KRandom>
+#include <KSaveFile>
+
+
+#ifdef KMESSDEBUG_PASSPORTLOGINSERVICE
+  #define KMESSDEBUG_PASSPORTTOKENCACHE
+#endif
+
+
+/**
+ * @brief Identifier of the token files
+ */
+#define TOKEN_CACHE_MAGIC       0x4b4d544b
+
+/**
+ * @brief Format version of the token files
+ */
+#define TOKEN_CACHE_VERSION     1
+
+/**
+ * @brief Size in bytes of the random nonce of each token file
+ */
+#define TOKEN_CACHE_NONCE_SIZE  16
+
+
+
+/**
+ * @brief Encrypt or decrypt data
+ *
+ * Each block of the keystream is the HMAC-SHA1 of the nonce and the block number.
+ *
+ * @param  key    The encryption key.
+ * @param  nonce  The random nonce of the file.
+ * @param  data   The data to encrypt or decrypt.
+ * @return The data XOR'ed with the keystream.
+ */
+QByteArray PassportTokenCache::applyKeyStream( const QByteArray &key, const QByteArray &nonce, const QByteArray &data )
+{
+  QByteArray result( data );
+  QByteArray block;
+  int blockIndex = 0;
+  int blockOffset = 0;
+
+  for( int index = 0; index < result.size(); ++index, ++blockOffset )
+  {
+    if( blockOffset == block.size() )
+    {
+      block = KMessShared::createHMACSha1( key, nonce + QByteArray::number( blockIndex++ ) );
+      blockOffset = 0;
+    }
+
+    result[ index ] = result.at( index ) ^ block.at( blockOffset );
+  }
+
+  return result;
+}
+
+
+
+/**
+ * @brief Remove the saved tokens of an account
+ *
+ * @param  handle  The account whose tokens to remove.
+ */
+void PassportTokenCache::clear( const QString &handle )
+{
+  QFile::remove( getPath( handle ) );
+}
+
+
+
+/**
+ * @brief Return the path of the token file of an account
+ */
+QString PassportTokenCache::getPath( const QString &handle )
+{
+  return KMessConfig::instance()->getAccountDirectory( handle ) + "/tokens.dat";
+}
+
+
+
+/**
+ * @brief Load the saved tokens of an account
+ *
+ * Expired tokens are loaded too: the caller decides whether they are still good enough.
+ *
+ * @param  handle           The account whose tokens to load.
+ * @param  password         The account password, used to decrypt the tokens.
+ * @param  tokens           Filled with the token values, by token name.
+ * @param  expirationDates  Filled with the local expiration dates, by token name.
+ * @return Whether the tokens have been loaded.
+ */
+bool PassportTokenCache::load( const QString &handle, const QString &password,
+                               QHash<QString,QString> &tokens, QHash<QString,QDateTime> &expirationDates )
+{
+  QFile file( getPath( handle ) );
+  if( ! file.exists() || ! file.open( QIODevice::ReadOnly ) )
+  {
+    return false;
+  }
+
+  QDataStream stream( &file );
+  stream.setVersion( QDataStream::Qt_4_5 );
+
+  quint32 magic, version;
+  QByteArray nonce, encrypted, mac;
+  stream >> magic >> version >> nonce >> encrypted >> mac;
+
+  if( stream.status() != QDataStream::Ok || magic != TOKEN_CACHE_MAGIC || version != TOKEN_CACHE_VERSION )
+  {
+    kWarning() << "Ignoring token file with unknown format:" << file.fileName();
+    return false;
+  }
+
+  const QByteArray passwordKey( password.toUtf8() );
+  const QByteArray macKey       ( KMessShared::deriveKey( passwordKey, "KMess token cache authentication " + handle.toUtf8() ) );
+  const QByteArray encryptionKey( KMessShared::deriveKey( passwordKey, "KMess token cache encryption "     + handle.toUtf8() ) );
+
+  // The file was saved with another password, or has been modified
+  if( KMessShared::createHMACSha1( macKey, nonce + encrypted ) != mac )
+  {
+#ifdef KMESSDEBUG_PASSPORTTOKENCACHE
+    kDebug() << "The saved tokens can't be authenticated, ignoring them.";
+#endif
+    return false;
+  }
+
+  QDataStream contents( applyKeyStream( encryptionKey, nonce, encrypted ) );
+  contents.setVersion( QDataStream::Qt_4_5 );
+
+  QHash<QString,QString>   loadedTokens;
+  QHash<QString,QDateTime> loadedExpirationDates;
+  contents >> loadedTokens >> loadedExpirationDates;
+
+  if( contents.status() != QDataStream::Ok )
+  {
+    kWarning() << "Ignoring truncated token file:" << file.fileName();
+    return false;
+  }
+
+#ifdef KMESSDEBUG_PASSPORTTOKENCACHE
+  kDebug() << "Loaded" << loadedTokens.count() << "saved tokens:" << loadedTokens.keys();
+#endif
+
+  tokens          = loadedTokens;
+  expirationDates = loadedExpirationDates;
+  return true;
+}
+
+
+
+/**
+ * @brief Remove a saved token of an account
+ *
+ * Used when the server rejects a token before it expires, so the next sessions don't load it again.
+ * Its proof token, if any, is removed too. The other tokens are kept.
+ *
+ * @param  handle     The account whose token to remove.
+ * @param  password   The account password, used to decrypt and encrypt the tokens.
+ * @param  tokenName  The name of the token to remove.
+ */
+void PassportTokenCache::remove( const QString &handle, const QString &password, const QString &tokenName )
+{
+  QHash<QString,QString>   tokens;
+  QHash<QString,QDateTime> expirationDates;
+
+  if( ! load( handle, password, tokens, expirationDates ) )
+  {
+    return;
+  }
+
+  // Saving again would be useless
+  if( ! tokens.contains( tokenName ) && ! expirationDates.contains( tokenName ) )
+  {
+    return;
+  }
+
+  tokens.remove( tokenName );
+  tokens.remove( tokenName + "Proof" );
+  expirationDates.remove( tokenName );
+
+  save( handle, password, tokens, expirationDates );
+}
+
+
+
+/**
+ * @brief Save the tokens of an account
+ *
+ * The file is only readable by the user.
+ *
+ * @param  handle           The account whose tokens to save.
+ * @param  password         The account password, used to encrypt the tokens.
+ * @param  tokens           The token values, by token name.
+ * @param  expirationDates  The local expiration dates, by token name.
+ */
+void PassportTokenCache::save( const QString &handle, const QString &password,
+                               const QHash<QString,QString> &tokens, const QHash<QString,QDateTime> &expirationDates )
+{
+  QByteArray plain;
+  QDataStream contents( &plain, QIODevice::WriteOnly );
+  contents.setVersion( QDataStream::Qt_4_5 );
+  contents << tokens << expirationDates;
+
+  QByteArray nonce;
+  while( nonce.size() < TOKEN_CACHE_NONCE_SIZE )
+  {
+    nonce += (char)( KRandom::random() & 0xff );
+  }
+
+  const QByteArray passwordKey( password.toUtf8() );
+  const QByteArray macKey       ( KMessShared::deriveKey( passwordKey, "KMess token cache authentication " + handle.toUtf8() ) );
+  const QByteArray encryptionKey( KMessShared::deriveKey( passwordKey, "KMess token cache encryption "     + handle.toUtf8() ) );
+
+  const QByteArray encrypted( applyKeyStream( encryptionKey, nonce, plain ) );
+  plain.fill( 0 );
+
+  KSaveFile file( getPath( handle ) );
+  if( ! file.open() )
+  {
+    kWarning() << "Unable to save the tokens:" << file.errorString();
+    return;
+  }
+
+  file.setPermissions( QFile::ReadOwner | QFile::WriteOwner );
+
+  QDataStream stream( &file );
+  stream.setVersion( QDataStream::Qt_4_5 );
+  stream << (quint32) TOKEN_CACHE_MAGIC << (quint32) TOKEN_CACHE_VERSION
+         << nonce << encrypted << KMessShared::createHMACSha1( macKey, nonce + encrypted );
+
+  if( ! file.finalize() )
+  {
+    kWarning() << "Unable to save the tokens:" << file.errorString();
+  }
+}
@@ -0,0 +1,61 @@
+/***************************************************************************
+                          passporttokencache.h
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef PASSPORTTOKENCACHE_H
+#define PASSPORTTOKENCACHE_H
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QHash>
+#include <QString>
+
+
+
+/**
+ * @brief Encrypted storage of the Passport tokens of an account.
+ *
+ * PassportLoginService saves the tokens it receives, with their expiration dates,
+ * so a new session can reuse them instead of logging in to the RST service again.
+ *
+ * The file is kept in the account directory. Its contents are encrypted with a key
+ * derived from the account password: an HMAC-SHA1 keystream, over a random nonce and
+ * a block counter, is XOR'ed with the data, and a second HMAC authenticates the result.
+ * A file saved with another password, or modified, is ignored.
+ *
+ * @ingroup NetworkSoap
+ */
+class PassportTokenCache
+{
+  public:  // public static methods
+    // Remove the saved tokens of an account
+    static void          clear( const QString &handle );
+    // Load the saved tokens of an account
+    static bool          load( const QString &handle, const QString &password,
+                               QHash<QString,QString> &tokens, QHash<QString,QDateTime> &expirationDates );
+    // Remove a saved token of an account
+    static void          remove( const QString &handle, const QString &password, const QString &tokenName );
+    // Save the tokens of an account
+    static void          save( const QString &handle, const QString &password,
+                               const QHash<QString,QString> &tokens, const QHash<QString,QDateTime> &expirationDates );
+
+  private:  // private static methods
+    // Encrypt or decrypt data
+    static QByteArray    applyKeyStream( const QByteArray &key, const QByteArray &nonce, const QByteArray &data );
+    // Return the path of the token file of an account
+    static QString       getPath( const QString &handle );
+};
+
+#endif
@@ -24,13 +24,13 @@
 #include "../../currentaccount.h"
 #include "../../kmessdebug.h"
 #include "soapmessage.h"
+#include "soaptransport.h"
 
 #include <QDateTime>
 #include <QDir>
 #include <QEventLoop>
 #include <QFileInfo>
 #include <QImageReader>
-#include <QNetworkAccessManager>
 #include <QNetworkReply>
 
 #include <KDateTime>
@@ -44,6 +44,7 @@
 RoamingService::RoamingService( QObject *parent )
 : PassportLoginService( parent )
 {
+  preconnect( SERVICE_URL_STORAGE_SERVICE );
 }
 
 
@@ -64,7 +65,7 @@ QString RoamingService::createCommonHeader() const
                   "</StorageApplicationHeader>\n"
                   "<StorageUserHeader xmlns=\"http://www.msn.com/webservices/storage/w10\">\n"
                     "<Puid>0</Puid>\n"
-                    "<TicketToken />\n" // Filled in by the base class
+                    "<TicketToken>" SOAP_TOKEN_PLACEHOLDER "</TicketToken>\n" // Filled in by the base class
                   "</StorageUserHeader>\n" );
   return header;
 }
@@ -420,13 +421,11 @@ void RoamingService::processProfileResult( const QDomElement &body )
 #ifdef KMESSDEBUG_ROAMINGSERVICE
     kDebug() << "Downloading display picture from storage";
 #endif
-    // Download the picture from the server into a temporary file
-    QNetworkAccessManager *manager = new QNetworkAccessManager( this );
+    // Download the picture from the server into a temporary file, over the shared connections
+    QNetworkReply *reply = SoapTransport::instance()->get( QNetworkRequest( QUrl( fullPictureUrl ) ) );
 
-    connect( manager, SIGNAL(               finished(QNetworkReply*) ),
-             this,    SLOT  ( receivedDisplayPicture(QNetworkReply*) ) );
-
-    manager->get( QNetworkRequest( QUrl( fullPictureUrl ) ) );
+    connect( reply, SIGNAL(                     finished() ),
+             this,  SLOT  ( receivedDisplayPictureData() ) );
   }
   else
   {
@@ -444,9 +443,13 @@ void RoamingService::processProfileResult( const QDomElement &body )
 
 
 // Received the display picture from the server
-void RoamingService::receivedDisplayPicture( QNetworkReply *reply )
+void RoamingService::receivedDisplayPictureData()
 {
   CurrentAccount *currentAccount = CurrentAccount::instance();
+  QNetworkReply  *reply          = qobject_cast<QNetworkReply*>( sender() );
+
+  // The reply is not needed anymore after this method
+  reply->deleteLater();
 
 #ifdef KMESSDEBUG_ROAMINGSERVICE
   kDebug() << "Saving received display picture of size" << reply->size();
@@ -469,9 +472,6 @@ void RoamingService::receivedDisplayPicture( QNetworkReply *reply )
     return;
   }
 
-  // We need to also delete the calling QNetworkAccessManager to avoid memory leaks
-  QNetworkAccessManager *manager = reply->manager();
-
   // check if the picture dir exists
   QDir accountDir( KMessConfig::instance()->getAccountDirectory( currentAccount->getHandle() ) );
   if( ! accountDir.exists( "displaypics" ) )
@@ -489,11 +489,6 @@ void RoamingService::receivedDisplayPicture( QNetworkReply *reply )
   // If the file can't be saved, do nothing
   if( ! file.open( QIODevice::WriteOnly ) )
   {
-    reply->deleteLater();
-    if( manager != 0 )
-    {
-      manager->deleteLater();
-    }
     return;
   }
 
@@ -502,14 +497,6 @@ void RoamingService::receivedDisplayPicture( QNetworkReply *reply )
   file.flush();
   file.close();
 
-  reply->deleteLater();
-
-  if( manager != 0 )
-  {
-    manager->deleteLater();
-    manager = 0;
-  }
-
   // Retrieve the picture's hash
   QString msnObjectHash( KMessShared::generateFileHash( tempPicturePath ).toBase64() );
   const QString safeMsnObjectHash( msnObjectHash.replace( QRegExp( "[^a-zA-Z0-9+=]"), "_" ) );
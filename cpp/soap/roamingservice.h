@@ -21,10 +21,6 @@
 #include "passportloginservice.h"
 
 
-// Forward declarations
-class QNetworkReply;
-
-
 
 /**
  * @brief Soap actions for retrieve the address book and membership lists.
@@ -53,7 +49,7 @@ class RoamingService : public PassportLoginService
 
   private slots:
     // Received the display picture from the server
-    void            receivedDisplayPicture( QNetworkReply *reply );
+    void            receivedDisplayPictureData();
 
   private: // Private methods
     // Create the common header for this service
@@ -17,8 +17,10 @@
 
 #include "soapmessage.h"
 
+#include "../../utils/kmessshared.h"
 #include "../../utils/xmlfunctions.h"
 #include "../../kmessdebug.h"
+#include "soapstreamparser.h"
 
 #include <QStringList>
 
@@ -59,6 +61,34 @@ SoapMessage::SoapMessage( const QString &endPointUrl, const QString &action, con
   envelope += "</soap:Envelope>";
 
   setMessage( envelope );
+
+  hasTokenPlaceholder_ = header.contains( SOAP_TOKEN_PLACEHOLDER );
+}
+
+
+
+/**
+ * @brief The constructor for requests created from a template
+ *
+ * The request is not parsed: the template is rendered with the given values when
+ * the request is sent, and the body and header trees stay empty.
+ *
+ * @param  endPointUrl      The URL of the SOAP endpoint.
+ * @param  action           The SOAP action.
+ * @param  requestTemplate  The compiled request envelope.
+ * @param  values           The values of the template slots.
+ * @param  data             Data to associate to the message.
+ */
+SoapMessage::SoapMessage( const QString &endPointUrl, const QString &action, const SoapRequestTemplate &requestTemplate,
+                          const SoapRequestValues &values, const MessageData &data )
+: action_( action )
+, data_( data )
+, endPoint_( endPointUrl )
+, isValid_( ! requestTemplate.isNull() )
+, hasTokenPlaceholder_( requestTemplate.hasSlot( SOAP_TOKEN_SLOT ) )
+, requestTemplate_( requestTemplate )
+, requestValues_( values )
+{
 }
 
 
@@ -68,12 +98,17 @@ SoapMessage::SoapMessage( const SoapMessage &other )
 : action_( other.action_ )
 , body_( other.body_ )
 , data_( other.data_ )
+, elementHandler_( other.elementHandler_ )
 , endPoint_( other.endPoint_ )
 , fault_( other.fault_ )
 , faultCode_( other.faultCode_ )
 , faultDescription_( other.faultDescription_ )
 , isValid_( other.isValid_ )
+, hasTokenPlaceholder_( other.hasTokenPlaceholder_ )
 , header_( other.header_ )
+, requestTemplate_( other.requestTemplate_ )
+, requestValues_( other.requestValues_ )
+, token_( other.token_ )
 {
 }
 
@@ -102,6 +137,14 @@ const MessageData& SoapMessage::getData() const
 
 
 
+// Return the handler for the elements of a streamed response body, if any
+SoapElementHandler *SoapMessage::getElementHandler() const
+{
+  return elementHandler_.data();
+}
+
+
+
 // Return the URL of the SOAP endpoint to which the message will be sent
 const QString& SoapMessage::getEndPoint() const
 {
@@ -143,14 +186,36 @@ QByteArray SoapMessage::getMessage() const
     return QByteArray();
   }
 
+  // Templates are already serialized
+  if( ! requestTemplate_.isNull() )
+  {
+    if( ! hasTokenPlaceholder_ )
+    {
+      return requestTemplate_.render( requestValues_ );
+    }
+
+    SoapRequestValues values( requestValues_ );
+    values.insert( SOAP_TOKEN_SLOT, token_ );
+    return requestTemplate_.render( values );
+  }
+
+  QByteArray header;
   QByteArray contents;
   QTextStream stream( &contents, QIODevice::Append );
 
   // Write the header
   if( ! header_.isNull() )
   {
-    stream << header_ << "\n";
-//     stream << "<soap:Header>\n" << header_ << "</soap:Header>\n";
+    QTextStream headerStream( &header, QIODevice::WriteOnly );
+    headerStream << header_ << "\n";
+//     headerStream << "<soap:Header>\n" << header_ << "</soap:Header>\n";
+    headerStream.flush();
+
+    // Write the token in place of its placeholder, which can only be in the header
+    if( hasTokenPlaceholder_ )
+    {
+      header.replace( SOAP_TOKEN_PLACEHOLDER, KMessShared::htmlEscape( token_ ).toUtf8() );
+    }
   }
 
   // Write the body
@@ -167,7 +232,7 @@ QByteArray SoapMessage::getMessage() const
          "<soap:Envelope xmlns:xsi=\""  XMLNS_XSI  "\""
                        " xmlns:xsd=\""  XMLNS_XSD  "\""
                        " xmlns:soap=\"" XMLNS_SOAP "\">\n"
-         + contents +
+         + header + contents +
          "</soap:Envelope>\n";
 }
 
@@ -189,6 +254,22 @@ QDomNode& SoapMessage::getHeader()
 
 
 
+// Return whether the message is rendered from a template
+bool SoapMessage::hasTemplate() const
+{
+  return ! requestTemplate_.isNull();
+}
+
+
+
+// Return whether the message header has a placeholder for the authentication token
+bool SoapMessage::hasTokenPlaceholder() const
+{
+  return hasTokenPlaceholder_;
+}
+
+
+
 // Return whether this was an error response. Note that you should only use this method on valid messages.
 bool SoapMessage::isFaultMessage() const
 {
@@ -197,6 +278,23 @@ bool SoapMessage::isFaultMessage() const
 
 
 
+/**
+ * @brief Return whether the request can be sent again without side effects
+ *
+ * Only the requests which read data, like ABFindAll, GetMetadata or GetProfile, are
+ * considered safe to repeat when their response doesn't arrive.
+ */
+bool SoapMessage::isIdempotent() const
+{
+  const QString method( action_.section( '/', -1 ) );
+
+  return method.startsWith( "Get" )
+      || method.startsWith( "Find" )
+      || method.startsWith( "ABFind" );
+}
+
+
+
 // Return whether this message contains valid useable data
 bool SoapMessage::isValid() const
 {
@@ -213,27 +311,43 @@ void SoapMessage::setData( const MessageData &data )
 
 
 
+/**
+ * @brief Set the handler which will process the response body while it's parsed
+ *
+ * When a request has an element handler, its response is parsed in streaming mode
+ * with SoapStreamParser: the response body is not kept, only the elements requested by
+ * the handler are extracted and passed to it. Copies of the message share the handler.
+ *
+ * @param  handler  The handler. The message takes ownership of it.
+ */
+void SoapMessage::setElementHandler( SoapElementHandler *handler )
+{
+  elementHandler_ = QSharedPointer<SoapElementHandler>( handler );
+}
+
+
+
 // Parse the incoming message
 void SoapMessage::setMessage( const QString &message )
 {
   QDomDocument xml;
+  QString      errorDescription;
 
   // Reset the error indicator
   faultCode_ = QString();
+  hasTokenPlaceholder_ = false;
+  requestTemplate_ = SoapRequestTemplate();
+  requestValues_.clear();
+  token_ = QString();
 
   // Parse the XML
   // see http://doc.trolltech.com/4.3/qdomdocument.html#setContent
-  isValid_ = xml.setContent( message, true, &faultDescription_ ); // true for namespace processing.
+  isValid_ = xml.setContent( message, true, &errorDescription ); // true for namespace processing.
 
   // Create an error message if the message can't be parsed
   if( ! isValid_ )
   {
-    faultCode_ = "parsingFailed";
-    body_      = QDomNode();
-    fault_     = QDomNode();
-    header_    = QDomNode();
-
-    kWarning() << "XML parsing failed (code" << faultCode_ << "):" << faultDescription_ << ".";
+    setParsingError( errorDescription );
     return;
   }
 
@@ -241,8 +355,71 @@ void SoapMessage::setMessage( const QString &message )
   header_    = XmlFunctions::getNode( xml, "/Envelope/Header" );
   body_      = XmlFunctions::getNode( xml, "/Envelope/Body" );
 
+  parseContents( XmlFunctions::getNode( xml, "/Envelope/Fault" ) );
+}
+
+
+
+/**
+ * @brief Use an incoming message which has been parsed in streaming mode
+ *
+ * If the message has an element handler, the body only contains the response node (without
+ * children) and the fault, if any: the rest of its contents have been given to the handler
+ * during the parsing.
+ *
+ * @param  parser  The parser which has received the whole message.
+ */
+void SoapMessage::setMessage( const SoapStreamParser &parser )
+{
+  // Reset the error indicator
+  faultCode_ = QString();
+  hasTokenPlaceholder_ = false;
+  requestTemplate_ = SoapRequestTemplate();
+  requestValues_.clear();
+  token_ = QString();
+
+  isValid_ = parser.isValid();
+
+  if( ! isValid_ )
+  {
+    setParsingError( parser.getErrorString() );
+    return;
+  }
+
+  header_    = parser.getHeader();
+  body_      = parser.getBody();
+
+  parseContents( parser.getFault() );
+}
+
+
+
+/**
+ * @brief Set the authentication token, to be written in place of the token placeholder
+ *
+ * Secure requests have SOAP_TOKEN_PLACEHOLDER in their header, either as text or
+ * as an attribute value. The token is escaped and spliced in the serialized message
+ * by getMessage(), so the header tree doesn't need to be searched or modified.
+ *
+ * @param  token  The token value.
+ */
+void SoapMessage::setToken( const QString &token )
+{
+#ifdef KMESSTEST
+  KMESS_ASSERT( hasTokenPlaceholder_ );
+#endif
+
+  token_ = token;
+}
+
+
+
+// Look for faults in the parsed message
+void SoapMessage::parseContents( const QDomNode &rootFault )
+{
+  fault_ = QDomNode();
+
   // Verify if any faults are present in the message
-  QDomNode rootFault = XmlFunctions::getNode( xml, "/Envelope/Fault" );
   QDomNode bodyFault;
   // Only check body_ if it's not null, or the assert in getNode will fail
   if( ! body_.isNull() )
@@ -277,3 +454,18 @@ void SoapMessage::setMessage( const QString &message )
 
 
 
+// Reset the message after a parsing error
+void SoapMessage::setParsingError( const QString &description )
+{
+  isValid_          = false;
+  faultCode_        = "parsingFailed";
+  faultDescription_ = description;
+  body_             = QDomNode();
+  fault_            = QDomNode();
+  header_           = QDomNode();
+
+  kWarning() << "XML parsing failed (code" << faultCode_ << "):" << faultDescription_ << ".";
+}
+
+
+
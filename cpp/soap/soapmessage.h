@@ -18,12 +18,33 @@
 #ifndef SOAPMESSAGE_H
 #define SOAPMESSAGE_H
 
+#include "soaprequesttemplate.h"
+
 #include <QDomNode>
+#include <QSharedPointer>
 #include <QString>
 #include <QUrl>
 #include <QVariant>
 
 
+class SoapElementHandler;
+class SoapStreamParser;
+
+
+
+/**
+ * @brief Name of the template slot for the authentication token of secure requests
+ */
+#define SOAP_TOKEN_SLOT         "ticketToken"
+
+/**
+ * @brief Placeholder for the authentication token in the header of secure requests
+ *
+ * It's replaced with the value given to SoapMessage::setToken() when the request is sent.
+ */
+#define SOAP_TOKEN_PLACEHOLDER  "%{" SOAP_TOKEN_SLOT "}"
+
+
 /**
  * @brief A simple container class for SOAP message data
  *
@@ -64,6 +85,8 @@ class SoapMessage
   public:  // public methods
     // The constructor
     explicit             SoapMessage( const QString &endPointUrl, const QString &action, const QString &header = QString(), const QString &body = QString(), const MessageData &data = MessageData() );
+    // The constructor for requests created from a template
+    explicit             SoapMessage( const QString &endPointUrl, const QString &action, const SoapRequestTemplate &requestTemplate, const SoapRequestValues &values, const MessageData &data = MessageData() );
     // The copy constructor
     explicit             SoapMessage( const SoapMessage &other );
     // The destructor
@@ -75,6 +98,8 @@ class SoapMessage
     const QDomNode&      getBody() const;
     // Return the associated request data
     const MessageData&   getData() const;
+    // Return the handler for the elements of a streamed response body, if any
+    SoapElementHandler  *getElementHandler() const;
     // Return the URL of the SOAP endpoint to which the message will be sent
     const QString&       getEndPoint() const;
     // Return the message fault's xml tree
@@ -87,14 +112,32 @@ class SoapMessage
     QDomNode&            getHeader();
     // Return the entire message as string
     QByteArray           getMessage() const;
+    // Return whether the message is rendered from a template
+    bool                 hasTemplate() const;
+    // Return whether the message header has a placeholder for the authentication token
+    bool                 hasTokenPlaceholder() const;
     // Return whether this is an error or a valid response
     bool                 isFaultMessage() const;
+    // Return whether the request can be sent again without side effects
+    bool                 isIdempotent() const;
     // Return whether this message contains valid useable data
     bool                 isValid() const;
     // Change the associated request data
     void                 setData( const MessageData &data );
+    // Set the handler which will process the response body while it's parsed
+    void                 setElementHandler( SoapElementHandler *handler );
     // Parse an incoming message
     void                 setMessage( const QString &message );
+    // Use an incoming message which has been parsed in streaming mode
+    void                 setMessage( const SoapStreamParser &parser );
+    // Reset the message after a parsing error
+    void                 setParsingError( const QString &description );
+    // Set the authentication token, to be written in place of the token placeholder
+    void                 setToken( const QString &token );
+
+  private:  // Private methods
+    // Look for faults in the parsed message
+    void                 parseContents( const QDomNode &rootFault );
 
 
   private:  // Protected properties
@@ -104,6 +147,8 @@ class SoapMessage
     QDomNode             body_;
     // Data associated to the message
     MessageData          data_;
+    // Handler for the elements of a streamed response body
+    QSharedPointer<SoapElementHandler> elementHandler_;
     // The target endpoint URL
     QString              endPoint_;
     // Contents of the message fault notice
@@ -114,8 +159,16 @@ class SoapMessage
     QString              faultDescription_;
     // Flag to easily check if the message contains useable data
     bool                 isValid_;
+    // Whether the header has a placeholder for the authentication token
+    bool                 hasTokenPlaceholder_;
     // The content header
     QDomNode             header_;
+    // The template of a request, rendered when the request is sent
+    SoapRequestTemplate  requestTemplate_;
+    // The values for the slots of the request template
+    SoapRequestValues    requestValues_;
+    // The authentication token of a secure request
+    QString              token_;
 };
 
 #endif
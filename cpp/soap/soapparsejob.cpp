@@ -0,0 +1,345 @@
+/***************************************************************************
+                          soapparsejob.cpp
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "soapparsejob.h"
+
+#include "../../kmessdebug.h"
+#include "soapresponsedecoder.h"
+
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QThreadPool>
+
+
+#ifdef KMESSDEBUG_SOAPMESSAGE
+  #define KMESSDEBUG_SOAPPARSEJOB
+#endif
+
+
+
+/**
+ * @brief Pool task which parses the queued chunks of a job.
+ *
+ * It holds a reference to the job, so the job can't be deleted while it's being parsed.
+ */
+class SoapParseRunner : public QRunnable
+{
+  public:
+    SoapParseRunner( const QSharedPointer<SoapParseJob> &job )
+    : job_( job )
+    {
+    }
+
+    void run()
+    {
+      job_->run();
+    }
+
+  private:
+    QSharedPointer<SoapParseJob> job_;
+};
+
+
+
+// The constructor
+SoapParseJob::SoapParseJob( const SoapMessage &response )
+: QObject( 0 )
+, decodedSize_( 0 )
+, decoder_( 0 )
+, isCancelled_( false )
+, isCompressionAccepted_( false )
+, isFinished_( false )
+, isFinishing_( false )
+, isScheduled_( false )
+, parser_( response.getElementHandler() )
+, response_( response )
+, wireSize_( 0 )
+{
+}
+
+
+
+// The destructor
+SoapParseJob::~SoapParseJob()
+{
+  delete decoder_;
+}
+
+
+
+/**
+ * @brief Create a new job
+ *
+ * The job is deleted with deleteLater() when the last reference is released, so
+ * it's always deleted in the thread which created it.
+ *
+ * @param  request  The request whose response will be parsed. A new, empty copy of its element
+ *                  handler, if any, will receive the elements of the response body, and will
+ *                  be available from the response.
+ */
+QSharedPointer<SoapParseJob> SoapParseJob::create( const SoapMessage &request )
+{
+  SoapMessage response( request );
+  if( request.getElementHandler() != 0 )
+  {
+    response.setElementHandler( request.getElementHandler()->createEmpty() );
+  }
+
+  QSharedPointer<SoapParseJob> job( new SoapParseJob( response ), &QObject::deleteLater );
+  job->self_ = job;
+  return job;
+}
+
+
+
+// Queue a new chunk of the response for parsing
+void SoapParseJob::addData( const QByteArray &data )
+{
+  QMutexLocker locker( &mutex_ );
+
+#ifdef KMESSTEST
+  KMESS_ASSERT( ! isFinishing_ );
+#endif
+
+  if( isCancelled_ || data.isEmpty() )
+  {
+    return;
+  }
+
+  wireSize_ += data.size();
+  chunks_.append( data );
+  schedule();
+}
+
+
+
+// Stop parsing, and never emit parsed()
+void SoapParseJob::cancel()
+{
+  QMutexLocker locker( &mutex_ );
+
+  isCancelled_ = true;
+  chunks_.clear();
+}
+
+
+
+// Queue the last chunk of the response, and complete the parsing
+void SoapParseJob::finish( const QByteArray &data )
+{
+  QMutexLocker locker( &mutex_ );
+
+  if( isCancelled_ || isFinishing_ )
+  {
+    return;
+  }
+
+  if( ! data.isEmpty() )
+  {
+    wireSize_ += data.size();
+    chunks_.append( data );
+  }
+
+  isFinishing_ = true;
+  schedule();
+}
+
+
+
+// Return the size of the parsed data, after decompression
+qint64 SoapParseJob::getDecodedSize() const
+{
+#ifdef KMESSTEST
+  KMESS_ASSERT( isFinished() );
+#endif
+
+  return decodedSize_;
+}
+
+
+
+// Return the response message, only valid after parsed() has been emitted
+const SoapMessage &SoapParseJob::getResponse() const
+{
+#ifdef KMESSTEST
+  KMESS_ASSERT( isFinished() );
+#endif
+
+  return response_;
+}
+
+
+
+// Return the size of the received data, before decompression
+qint64 SoapParseJob::getWireSize() const
+{
+  QMutexLocker locker( &mutex_ );
+  return wireSize_;
+}
+
+
+
+// Return whether the job has been cancelled
+bool SoapParseJob::isCancelled() const
+{
+  QMutexLocker locker( &mutex_ );
+  return isCancelled_;
+}
+
+
+
+// Return whether all the response has been parsed
+bool SoapParseJob::isFinished() const
+{
+  QMutexLocker locker( &mutex_ );
+  return isFinished_;
+}
+
+
+
+/**
+ * @brief Parse the queued chunks, in the worker thread
+ *
+ * The mutex is only held to take the chunks from the queue, not while parsing them,
+ * so the network thread is never blocked by the parsing.
+ */
+void SoapParseJob::run()
+{
+  forever
+  {
+    QList<QByteArray> chunks;
+    bool isLastChunk;
+
+    {
+      QMutexLocker locker( &mutex_ );
+
+      if( isCancelled_ || ( chunks_.isEmpty() && ! isFinishing_ ) )
+      {
+        // Nothing left to do: the next chunk will start a new worker
+        isScheduled_ = false;
+        return;
+      }
+
+      chunks = chunks_;
+      chunks_.clear();
+      isLastChunk = isFinishing_;
+    }
+
+    foreach( const QByteArray &chunk, chunks )
+    {
+      if( decoder_ == 0 )
+      {
+        decodedSize_ += chunk.size();
+        parser_.addData( chunk );
+        continue;
+      }
+
+      const QByteArray decoded( decoder_->decode( chunk ) );
+      decodedSize_ += decoded.size();
+      parser_.addData( decoded );
+    }
+
+    if( ! isLastChunk )
+    {
+      continue;
+    }
+
+    parser_.finish();
+    response_.setMessage( parser_ );
+
+    // Without this, the missing data would look like a truncated response
+    if( decoder_ != 0 && decoder_->hasError() )
+    {
+      response_.setParsingError( "Unable to decompress the " + QString::fromLatin1( contentEncoding_ ) + " response" );
+    }
+
+    {
+      QMutexLocker locker( &mutex_ );
+
+      if( isCancelled_ )
+      {
+        return;
+      }
+
+      isFinished_ = true;
+    }
+
+#ifdef KMESSDEBUG_SOAPPARSEJOB
+    kDebug() << "Response parsed, valid:" << parser_.isValid();
+#endif
+
+    // Delivered to the creator's thread by a queued connection
+    emit parsed();
+    return;
+  }
+}
+
+
+
+/**
+ * @brief Set whether the request asked for compressed responses
+ *
+ * When it didn't, the network library may have asked for them on its own, and decompressed
+ * the response itself: the Content-Encoding header is then ignored.
+ *
+ * @param  accepted  Whether the request had our Accept-Encoding header.
+ */
+void SoapParseJob::setCompressionAccepted( bool accepted )
+{
+  QMutexLocker locker( &mutex_ );
+  isCompressionAccepted_ = accepted;
+}
+
+
+
+/**
+ * @brief Set the content encoding of the response, to decompress it
+ *
+ * It's only taken into account before the first chunk is queued, and only if the
+ * request asked for compressed responses.
+ *
+ * @param  encoding  The value of the Content-Encoding header; empty or "identity" if not compressed.
+ */
+void SoapParseJob::setContentEncoding( const QByteArray &encoding )
+{
+  QMutexLocker locker( &mutex_ );
+
+  if( ! isCompressionAccepted_ || decoder_ != 0 || wireSize_ > 0 || ! SoapResponseDecoder::isSupported( encoding ) )
+  {
+    return;
+  }
+
+  contentEncoding_ = encoding.trimmed().toLower();
+  decoder_ = new SoapResponseDecoder( encoding );
+}
+
+
+
+// Start a worker for the queued chunks, if needed. The mutex must be locked.
+void SoapParseJob::schedule()
+{
+  if( isScheduled_ )
+  {
+    return;
+  }
+
+  isScheduled_ = true;
+  QThreadPool::globalInstance()->start( new SoapParseRunner( self_.toStrongRef() ) );
+}
+
+
+
+#include "soapparsejob.moc"
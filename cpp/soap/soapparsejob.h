@@ -0,0 +1,140 @@
+/***************************************************************************
+                          soapparsejob.h
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef SOAPPARSEJOB_H
+#define SOAPPARSEJOB_H
+
+#include "soapmessage.h"
+#include "soapstreamparser.h"
+
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QSharedPointer>
+#include <QWeakPointer>
+
+
+// Forward declarations
+class SoapResponseDecoder;
+
+
+/**
+ * @brief Parses a SOAP response in a worker thread.
+ *
+ * HttpSoapConnection creates a job for each request it sends, and passes to it the
+ * chunks of the reply as they arrive from the network. The chunks are queued, and parsed
+ * with a SoapStreamParser by a QThreadPool thread. When the last chunk has been parsed,
+ * the response message is completed with the parsing results, and the parsed() signal
+ * is emitted, to be delivered to the thread which created the job.
+ *
+ * Compressed replies are decompressed by the worker too, right before parsing each chunk:
+ * call setCompressionAccepted() when the request asked for compressed responses, and
+ * setContentEncoding() before queueing the first chunk. A response which can't be
+ * decompressed is reported as a parsing error.
+ *
+ * Ownership rules:
+ * - the job fills its own SoapElementHandler, created from the one of the request: a request
+ *   which is sent again, after a timeout, gets a new job which never shares a handler with
+ *   the cancelled one, even if that one is still being parsed;
+ * - the parser, the handler and the response belong to the worker thread until parsed()
+ *   is emitted; after that, only the creating thread uses them;
+ * - the chunk queue and the state flags are protected by the job's mutex;
+ * - the job is shared between its creator and the pool: it's deleted, in the creating
+ *   thread, when both have released it. cancel() allows the creator to drop a job
+ *   which is still being parsed.
+ *
+ * @ingroup NetworkSoap
+ */
+class SoapParseJob : public QObject
+{
+  Q_OBJECT
+
+  friend class SoapParseRunner;
+
+  public:  // public static methods
+    // Create a new job
+    static QSharedPointer<SoapParseJob> create( const SoapMessage &request );
+
+  public:  // public methods
+    // The destructor
+    virtual             ~SoapParseJob();
+
+    // Queue a new chunk of the response for parsing
+    void                 addData( const QByteArray &data );
+    // Stop parsing, and never emit parsed()
+    void                 cancel();
+    // Queue the last chunk of the response, and complete the parsing
+    void                 finish( const QByteArray &data = QByteArray() );
+    // Return the size of the parsed data, after decompression
+    qint64               getDecodedSize() const;
+    // Return the response message, only valid after parsed() has been emitted
+    const SoapMessage   &getResponse() const;
+    // Return the size of the received data, before decompression
+    qint64               getWireSize() const;
+    // Return whether the job has been cancelled
+    bool                 isCancelled() const;
+    // Return whether all the response has been parsed
+    bool                 isFinished() const;
+    // Set whether the request asked for compressed responses
+    void                 setCompressionAccepted( bool accepted );
+    // Set the content encoding of the response, to decompress it
+    void                 setContentEncoding( const QByteArray &encoding );
+
+  private:  // private methods
+    // The constructor
+    explicit             SoapParseJob( const SoapMessage &response );
+    // Parse the queued chunks, in the worker thread
+    void                 run();
+    // Start a worker for the queued chunks, if needed. The mutex must be locked.
+    void                 schedule();
+
+  private:  // private properties
+    // Chunks received but not parsed yet
+    QList<QByteArray>    chunks_;
+    // The content encoding of the response, if it's decompressed
+    QByteArray           contentEncoding_;
+    // Size of the parsed data, only used by the worker thread until parsed() is emitted
+    qint64               decodedSize_;
+    // Decompresses the chunks, if the response is compressed
+    SoapResponseDecoder *decoder_;
+    // Whether cancel() has been called
+    bool                 isCancelled_;
+    // Whether the request asked for compressed responses
+    bool                 isCompressionAccepted_;
+    // Whether the whole response has been parsed
+    bool                 isFinished_;
+    // Whether finish() has been called
+    bool                 isFinishing_;
+    // Whether a worker has been started for the queued chunks
+    bool                 isScheduled_;
+    // Protects the chunks and the state flags
+    mutable QMutex       mutex_;
+    // The actual parser, only used by the worker thread
+    SoapStreamParser     parser_;
+    // The response, a copy of the request until the parsing is complete
+    SoapMessage          response_;
+    // Reference to the job itself, to keep it alive while a worker uses it
+    QWeakPointer<SoapParseJob> self_;
+    // Size of the received data
+    qint64               wireSize_;
+
+  signals:
+    // The whole response has been parsed
+    void                 parsed();
+};
+
+#endif
@@ -0,0 +1,223 @@
+/***************************************************************************
+                          soapredirectioncache.cpp
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "soapredirectioncache.h"
+
+#include "../../kmessdebug.h"
+
+#include <QDataStream>
+#include <QFile>
+
+#include <KSaveFile>
+#include <KStandardDirs>
+
+
+#ifdef KMESSDEBUG_HTTPSOAPCONNECTION
+  #define KMESSDEBUG_SOAPREDIRECTIONCACHE
+#endif
+
+
+/**
+ * @brief Identifier of the redirections file
+ */
+#define REDIRECTION_CACHE_MAGIC    0x4b4d5244
+
+/**
+ * @brief Format version of the redirections file
+ */
+#define REDIRECTION_CACHE_VERSION  1
+
+/**
+ * @brief Seconds after which a redirection is forgotten
+ *
+ * The preferred hosts are suggested again with each response, which extends the redirection.
+ */
+#define REDIRECTION_CACHE_TTL      86400
+
+
+
+// The constructor
+SoapRedirectionCache::SoapRedirectionCache()
+{
+  load();
+}
+
+
+
+// Return the instance of the cache
+SoapRedirectionCache *SoapRedirectionCache::instance()
+{
+  static SoapRedirectionCache cache;
+  return &cache;
+}
+
+
+
+/**
+ * @brief Save a redirection
+ *
+ * Saving it again extends its validity. The file is only written when the target changes,
+ * or when half of the validity has passed, since the preferred hosts come with every response.
+ *
+ * @param  host        The host which redirects.
+ * @param  targetHost  The host to use instead.
+ */
+void SoapRedirectionCache::addRedirection( const QString &host, const QString &targetHost )
+{
+  const QDateTime now( QDateTime::currentDateTime() );
+  const bool needsSaving = ( targets_.value( host ) != targetHost
+                          || expirationDates_.value( host ) < now.addSecs( REDIRECTION_CACHE_TTL / 2 ) );
+
+  targets_        .insert( host, targetHost );
+  expirationDates_.insert( host, now.addSecs( REDIRECTION_CACHE_TTL ) );
+
+  if( needsSaving )
+  {
+#ifdef KMESSDEBUG_SOAPREDIRECTIONCACHE
+    kDebug() << "Saving redirection from" << host << "to" << targetHost;
+#endif
+    save();
+  }
+}
+
+
+
+// Return the path of the redirections file
+QString SoapRedirectionCache::getPath()
+{
+  return KStandardDirs::locateLocal( "appdata", "soapredirections.dat" );
+}
+
+
+
+/**
+ * @brief Return the host to use instead of the given one, if any
+ *
+ * @param  host  The host of an endpoint.
+ * @return The host to send the requests to, or an empty string if the host doesn't redirect.
+ */
+QString SoapRedirectionCache::getTarget( const QString &host )
+{
+  QHash<QString,QDateTime>::iterator expiration( expirationDates_.find( host ) );
+  if( expiration == expirationDates_.end() )
+  {
+    return QString();
+  }
+
+  if( expiration.value() < QDateTime::currentDateTime() )
+  {
+#ifdef KMESSDEBUG_SOAPREDIRECTIONCACHE
+    kDebug() << "The redirection from" << host << "has expired.";
+#endif
+    expirationDates_.erase( expiration );
+    targets_.remove( host );
+    return QString();
+  }
+
+  return targets_.value( host );
+}
+
+
+
+/**
+ * @brief Forget the redirection of a host
+ *
+ * Called when a request to the target host failed: the next requests go to the original host,
+ * which will redirect again if needed.
+ *
+ * @param  host  The original host.
+ */
+void SoapRedirectionCache::invalidate( const QString &host )
+{
+  if( ! targets_.contains( host ) )
+  {
+    return;
+  }
+
+#ifdef KMESSDEBUG_SOAPREDIRECTIONCACHE
+  kDebug() << "Forgetting the redirection from" << host << "to" << targets_.value( host );
+#endif
+
+  targets_.remove( host );
+  expirationDates_.remove( host );
+  save();
+}
+
+
+
+// Load the saved redirections
+void SoapRedirectionCache::load()
+{
+  QFile file( getPath() );
+  if( ! file.exists() || ! file.open( QIODevice::ReadOnly ) )
+  {
+    return;
+  }
+
+  QDataStream stream( &file );
+  stream.setVersion( QDataStream::Qt_4_5 );
+
+  quint32 magic, version;
+  QHash<QString,QString>   targets;
+  QHash<QString,QDateTime> expirationDates;
+  stream >> magic >> version >> targets >> expirationDates;
+
+  if( stream.status() != QDataStream::Ok || magic != REDIRECTION_CACHE_MAGIC || version != REDIRECTION_CACHE_VERSION )
+  {
+    kWarning() << "Ignoring redirections file with unknown format:" << file.fileName();
+    return;
+  }
+
+  // Only keep the redirections which are still valid
+  const QDateTime now( QDateTime::currentDateTime() );
+  QHashIterator<QString,QDateTime> it( expirationDates );
+  while( it.hasNext() )
+  {
+    it.next();
+    if( it.value() > now && targets.contains( it.key() ) )
+    {
+      targets_        .insert( it.key(), targets.value( it.key() ) );
+      expirationDates_.insert( it.key(), it.value() );
+    }
+  }
+
+#ifdef KMESSDEBUG_SOAPREDIRECTIONCACHE
+  kDebug() << "Loaded" << targets_.count() << "saved redirections:" << targets_;
+#endif
+}
+
+
+
+// Save the redirections
+void SoapRedirectionCache::save() const
+{
+  KSaveFile file( getPath() );
+  if( ! file.open() )
+  {
+    kWarning() << "Unable to save the redirections:" << file.errorString();
+    return;
+  }
+
+  QDataStream stream( &file );
+  stream.setVersion( QDataStream::Qt_4_5 );
+  stream << (quint32) REDIRECTION_CACHE_MAGIC << (quint32) REDIRECTION_CACHE_VERSION
+         << targets_ << expirationDates_;
+
+  if( ! file.finalize() )
+  {
+    kWarning() << "Unable to save the redirections:" << file.errorString();
+  }
+}
@@ -0,0 +1,71 @@
+/***************************************************************************
+                          soapredirectioncache.h
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef SOAPREDIRECTIONCACHE_H
+#define SOAPREDIRECTIONCACHE_H
+
+#include <QDateTime>
+#include <QHash>
+#include <QString>
+
+
+
+/**
+ * @brief The host redirections of the web services, shared and saved.
+ *
+ * The web services redirect the clients to other hosts, with a psf:Redirect fault or
+ * with the PreferredHostName header. Each HttpSoapConnection used to keep the redirections
+ * it learnt for itself, so every new connection, and every new session, had to waste a
+ * request to find them again.
+ *
+ * The redirections are now shared by all connections, and saved to disk, so the first
+ * request of a session goes to the preferred host right away. Each redirection expires
+ * after a while, and is forgotten as soon as a request to the redirected host fails.
+ *
+ * @ingroup NetworkSoap
+ */
+class SoapRedirectionCache
+{
+  public:  // public static methods
+    // Return the instance of the cache
+    static SoapRedirectionCache *instance();
+
+  public:  // public methods
+    // Save a redirection
+    void                 addRedirection( const QString &host, const QString &targetHost );
+    // Return the host to use instead of the given one, if any
+    QString              getTarget( const QString &host );
+    // Forget the redirection of a host
+    void                 invalidate( const QString &host );
+
+  private:  // private methods
+    // The constructor
+                         SoapRedirectionCache();
+    // Return the path of the redirections file
+    static QString       getPath();
+    // Load the saved redirections
+    void                 load();
+    // Save the redirections
+    void                 save() const;
+
+  private:  // private properties
+    // The expiration dates of the redirections, by original host
+    QHash<QString,QDateTime> expirationDates_;
+    // The target hosts, by original host
+    QHash<QString,QString> targets_;
+};
+
+#endif
@@ -0,0 +1,184 @@
+/***************************************************************************
+                          soaprequesttemplate.cpp
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "soaprequesttemplate.h"
+
+#include "../../utils/kmessshared.h"
+#include "../../kmessdebug.h"
+
+
+#define XMLNS_XSD  "http://www.w3.org/2001/XMLSchema"
+#define XMLNS_XSI  "http://www.w3.org/2001/XMLSchema-instance"
+#define XMLNS_SOAP "http://schemas.xmlsoap.org/soap/envelope/"
+
+
+
+// Create an empty template
+SoapRequestTemplate::SoapRequestTemplate()
+: textSize_( 0 )
+{
+}
+
+
+
+/**
+ * @brief Compile a new template
+ *
+ * @param  header  Contents of the <code>soap:Header</code> element. If empty, the element is omitted.
+ * @param  body    Contents of the <code>soap:Body</code> element.
+ */
+SoapRequestTemplate::SoapRequestTemplate( const QString &header, const QString &body )
+: textSize_( 0 )
+{
+  QString envelope( "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+                    "<soap:Envelope xmlns:xsi=\""  XMLNS_XSI  "\""
+                                  " xmlns:xsd=\""  XMLNS_XSD  "\""
+                                  " xmlns:soap=\"" XMLNS_SOAP "\">\n" );
+
+  if( ! header.isEmpty() )
+  {
+    envelope += "<soap:Header>" + header + "</soap:Header>\n";
+  }
+
+  envelope += "<soap:Body>" + body + "</soap:Body>\n"
+              "</soap:Envelope>\n";
+
+  compile( envelope );
+}
+
+
+
+// Split a source text into segments
+void SoapRequestTemplate::compile( const QString &source )
+{
+  int position = 0;
+
+  forever
+  {
+    Segment segment;
+    segment.isRaw = false;
+
+    const int slotStart = source.indexOf( "%{", position );
+    const int slotEnd   = ( slotStart == -1 ) ? -1 : source.indexOf( '}', slotStart );
+
+    // No more slots: the rest of the source is the last segment
+    if( slotEnd == -1 )
+    {
+      segment.text = source.mid( position ).toUtf8();
+      textSize_ += segment.text.size();
+      segments_.append( segment );
+      return;
+    }
+
+    segment.text = source.mid( position, slotStart - position ).toUtf8();
+    segment.slot = source.mid( slotStart + 2, slotEnd - slotStart - 2 );
+
+    if( segment.slot.startsWith( '*' ) )
+    {
+      segment.isRaw = true;
+      segment.slot.remove( 0, 1 );
+    }
+
+#ifdef KMESSTEST
+    KMESS_ASSERT( ! segment.slot.isEmpty() );
+#endif
+
+    textSize_ += segment.text.size();
+    segments_.append( segment );
+
+    position = slotEnd + 1;
+  }
+}
+
+
+
+// Return whether the template has a slot with the given name
+bool SoapRequestTemplate::hasSlot( const QString &name ) const
+{
+  foreach( const Segment &segment, segments_ )
+  {
+    if( segment.slot == name )
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+
+// Return whether the template is empty
+bool SoapRequestTemplate::isNull() const
+{
+  return segments_.isEmpty();
+}
+
+
+
+/**
+ * @brief Return the request envelope, with the slots filled with the given values
+ *
+ * Slots without a value are left empty.
+ *
+ * @param  values  The values of the slots, by name.
+ * @return The UTF-8 encoded envelope, ready to be sent.
+ */
+QByteArray SoapRequestTemplate::render( const SoapRequestValues &values ) const
+{
+  QList<QByteArray> slotValues;
+  int size = textSize_;
+
+  // Encode the values first, to allocate the result only once
+  foreach( const Segment &segment, segments_ )
+  {
+    if( segment.slot.isEmpty() )
+    {
+      slotValues.append( QByteArray() );
+      continue;
+    }
+
+    SoapRequestValues::const_iterator value( values.constFind( segment.slot ) );
+    if( value == values.constEnd() )
+    {
+      kWarning() << "No value for the request slot" << segment.slot << "!";
+      slotValues.append( QByteArray() );
+      continue;
+    }
+
+    if( segment.isRaw )
+    {
+      slotValues.append( value.value().toUtf8() );
+    }
+    else
+    {
+      slotValues.append( KMessShared::htmlEscape( value.value() ).toUtf8() );
+    }
+
+    size += slotValues.last().size();
+  }
+
+  QByteArray message;
+  message.reserve( size );
+
+  for( int index = 0; index < segments_.count(); ++index )
+  {
+    message += segments_.at( index ).text;
+    message += slotValues.at( index );
+  }
+
+  return message;
+}
@@ -0,0 +1,93 @@
+/***************************************************************************
+                          soaprequesttemplate.h
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef SOAPREQUESTTEMPLATE_H
+#define SOAPREQUESTTEMPLATE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QString>
+
+
+
+/**
+ * @brief Values for the slots of a SoapRequestTemplate, by slot name
+ */
+typedef QHash<QString,QString> SoapRequestValues;
+
+
+
+/**
+ * @brief A SOAP request envelope, compiled once and rendered many times.
+ *
+ * Building requests with the QString based SoapMessage constructor means parsing
+ * each envelope into a DOM tree, and serializing the tree back when the request is sent.
+ * Most requests are constant text with a few variable values: a template compiles the
+ * envelope, header and body once, as UTF-8 segments, and rendering it with the values of
+ * a request is a single concatenation.
+ *
+ * The header and body sources can contain named slots:
+ * - <code>%{name}</code> is replaced by the value, with the XML special characters escaped;
+ * - <code>%{*name}</code> is replaced by the value as is, for XML fragments.
+ *
+ * Templates are implicitly shared, and are usually created as static objects:
+ * @code
+ * static const SoapRequestTemplate getMetadata( header, "<GetMetadata xmlns=\"...\" />" );
+ * sendRequest( new SoapMessage( url, action, getMetadata, values, data ) );
+ * @endcode
+ *
+ * @ingroup NetworkSoap
+ */
+class SoapRequestTemplate
+{
+  public:  // public methods
+    // Create an empty template
+                         SoapRequestTemplate();
+    // Compile a new template
+                         SoapRequestTemplate( const QString &header, const QString &body );
+
+    // Return whether the template has a slot with the given name
+    bool                 hasSlot( const QString &name ) const;
+    // Return whether the template is empty
+    bool                 isNull() const;
+    // Return the request envelope, with the slots filled with the given values
+    QByteArray           render( const SoapRequestValues &values ) const;
+
+  private:  // private structures
+    // A constant part of the envelope, followed by a slot
+    struct Segment
+    {
+      // UTF-8 text of the constant part
+      QByteArray         text;
+      // Name of the slot after the text, empty for the last segment
+      QString            slot;
+      // Whether the slot value is an XML fragment, and must not be escaped
+      bool               isRaw;
+    };
+
+  private:  // private methods
+    // Split a source text into segments
+    void                 compile( const QString &source );
+
+  private:  // private properties
+    // The compiled envelope
+    QList<Segment>       segments_;
+    // Total size of the constant parts
+    int                  textSize_;
+};
+
+#endif
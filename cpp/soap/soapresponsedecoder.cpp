@@ -0,0 +1,172 @@
+/***************************************************************************
+                          soapresponsedecoder.cpp
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "soapresponsedecoder.h"
+
+#include "../../kmessdebug.h"
+
+#include <zlib.h>
+
+
+/**
+ * @brief Size of the buffer used for each decompression step
+ */
+#define DECODER_BUFFER_SIZE  16384
+
+
+
+/**
+ * @brief The constructor
+ *
+ * @param  encoding  The content encoding of the response, "gzip" or "deflate".
+ */
+SoapResponseDecoder::SoapResponseDecoder( const QByteArray &encoding )
+: hasError_( false )
+, isFinished_( false )
+, isGzip_( encoding.trimmed().toLower() == "gzip" || encoding.trimmed().toLower() == "x-gzip" )
+, isRawDeflate_( false )
+, stream_( new z_stream() )
+{
+#ifdef KMESSTEST
+  KMESS_ASSERT( isSupported( encoding ) );
+#endif
+
+  hasError_ = ! initialize( false );
+}
+
+
+
+// The destructor
+SoapResponseDecoder::~SoapResponseDecoder()
+{
+  inflateEnd( stream_ );
+  delete stream_;
+}
+
+
+
+/**
+ * @brief Decompress a chunk of the response
+ *
+ * @param  data  The next compressed chunk.
+ * @return The data which could be decompressed, possibly empty.
+ */
+QByteArray SoapResponseDecoder::decode( const QByteArray &data )
+{
+  QByteArray decoded;
+
+  if( hasError_ || isFinished_ || data.isEmpty() )
+  {
+    return decoded;
+  }
+
+  char buffer[ DECODER_BUFFER_SIZE ];
+
+  stream_->next_in  = reinterpret_cast<Bytef*>( const_cast<char*>( data.constData() ) );
+  stream_->avail_in = data.size();
+
+  do
+  {
+    stream_->next_out  = reinterpret_cast<Bytef*>( buffer );
+    stream_->avail_out = DECODER_BUFFER_SIZE;
+
+    const int result = inflate( stream_, Z_NO_FLUSH );
+
+    // Data without the zlib wrapper: start again in raw mode
+    if( result == Z_DATA_ERROR && ! isGzip_ && ! isRawDeflate_ && stream_->total_out == 0 )
+    {
+      inflateEnd( stream_ );
+      if( ! initialize( true ) )
+      {
+        hasError_ = true;
+        return decoded;
+      }
+
+      return decode( data );
+    }
+
+    if( result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR )
+    {
+      kWarning() << "Unable to decompress the response:" << ( stream_->msg ? stream_->msg : "unknown error" );
+      hasError_ = true;
+      return decoded;
+    }
+
+    decoded.append( buffer, DECODER_BUFFER_SIZE - stream_->avail_out );
+
+    if( result == Z_STREAM_END )
+    {
+      isFinished_ = true;
+      break;
+    }
+  }
+  while( stream_->avail_out == 0 );
+
+  return decoded;
+}
+
+
+
+// Return whether the data could not be decompressed
+bool SoapResponseDecoder::hasError() const
+{
+  return hasError_;
+}
+
+
+
+// Prepare the decompression stream
+bool SoapResponseDecoder::initialize( bool isRawDeflate )
+{
+  isRawDeflate_ = isRawDeflate;
+
+  stream_->zalloc   = Z_NULL;
+  stream_->zfree    = Z_NULL;
+  stream_->opaque   = Z_NULL;
+  stream_->next_in  = Z_NULL;
+  stream_->avail_in = 0;
+
+  int windowBits;
+  if( isGzip_ )
+  {
+    windowBits = 16 + MAX_WBITS;
+  }
+  else if( isRawDeflate_ )
+  {
+    windowBits = -MAX_WBITS;
+  }
+  else
+  {
+    windowBits = MAX_WBITS;
+  }
+
+  if( inflateInit2( stream_, windowBits ) != Z_OK )
+  {
+    kWarning() << "Unable to initialize the response decompression!";
+    return false;
+  }
+
+  return true;
+}
+
+
+
+// Return whether a content encoding can be decoded
+bool SoapResponseDecoder::isSupported( const QByteArray &encoding )
+{
+  const QByteArray name( encoding.trimmed().toLower() );
+  return name == "gzip" || name == "x-gzip" || name == "deflate";
+}
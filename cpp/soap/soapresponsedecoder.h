@@ -0,0 +1,80 @@
+/***************************************************************************
+                          soapresponsedecoder.h
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef SOAPRESPONSEDECODER_H
+#define SOAPRESPONSEDECODER_H
+
+#include <QByteArray>
+
+
+// Forward declarations
+struct z_stream_s;
+
+
+
+/**
+ * @brief Incremental decompression of a compressed HTTP response.
+ *
+ * The requests accept gzip and deflate compressed responses, since the SOAP XML
+ * compresses very well. A decoder is created for each compressed reply, and is
+ * given the chunks of the reply as they arrive: each call to decode() returns the
+ * data which could be decompressed so far, so the parser never waits for the
+ * whole response.
+ *
+ * Both zlib wrapped and raw deflate data are accepted for the "deflate" encoding,
+ * since servers don't agree on which one it means.
+ *
+ * @ingroup NetworkSoap
+ */
+class SoapResponseDecoder
+{
+  public:  // public static methods
+    // Return whether a content encoding can be decoded
+    static bool          isSupported( const QByteArray &encoding );
+
+  public:  // public methods
+    // The constructor
+    explicit             SoapResponseDecoder( const QByteArray &encoding );
+    // The destructor
+                        ~SoapResponseDecoder();
+
+    // Decompress a chunk of the response
+    QByteArray           decode( const QByteArray &data );
+    // Return whether the data could not be decompressed
+    bool                 hasError() const;
+
+  private:  // private methods
+    // Prepare the decompression stream
+    bool                 initialize( bool isRawDeflate );
+
+  private:  // private properties
+    // Whether the data could not be decompressed
+    bool                 hasError_;
+    // Whether the end of the compressed data has been reached
+    bool                 isFinished_;
+    // Whether the data is gzip compressed, otherwise it's deflate compressed
+    bool                 isGzip_;
+    // Whether the deflate data has no zlib wrapper
+    bool                 isRawDeflate_;
+    // The zlib decompression stream
+    z_stream_s          *stream_;
+
+  private:  // disabled methods
+                         SoapResponseDecoder( const SoapResponseDecoder &other );
+    SoapResponseDecoder &operator=( const SoapResponseDecoder &other );
+};
+
+#endif
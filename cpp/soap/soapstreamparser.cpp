@@ -0,0 +1,350 @@
+/***************************************************************************
+                          soapstreamparser.cpp
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "soapstreamparser.h"
+
+#include "../../kmessdebug.h"
+
+
+#ifdef KMESSDEBUG_SOAPMESSAGE
+  #define KMESSDEBUG_SOAPSTREAMPARSER
+#endif
+
+
+
+// The constructor
+SoapStreamParser::SoapStreamParser( SoapElementHandler *handler )
+: depth_( 0 )
+, hasResponseNode_( false )
+, handler_( handler )
+, isFinished_( false )
+, isExtracting_( false )
+, isInBody_( false )
+, treeDepth_( 0 )
+{
+  if( handler_ != 0 )
+  {
+    elementNames_ = handler_->getElementNames().toSet();
+  }
+
+  reader_.setNamespaceProcessing( true );
+}
+
+
+
+// The destructor
+SoapStreamParser::~SoapStreamParser()
+{
+}
+
+
+
+// Parse a new chunk of the message
+void SoapStreamParser::addData( const QByteArray &data )
+{
+#ifdef KMESSTEST
+  KMESS_ASSERT( ! isFinished_ );
+#endif
+
+  reader_.addData( data );
+  parse();
+}
+
+
+
+// Create a DOM element for the current start element
+QDomElement SoapStreamParser::createElement()
+{
+  QDomElement element( document_.createElementNS( reader_.namespaceUri().toString(),
+                                                  reader_.qualifiedName().toString() ) );
+
+  foreach( const QXmlStreamAttribute &attribute, reader_.attributes() )
+  {
+    if( attribute.namespaceUri().isEmpty() )
+    {
+      element.setAttribute( attribute.name().toString(), attribute.value().toString() );
+    }
+    else
+    {
+      element.setAttributeNS( attribute.namespaceUri().toString(),
+                              attribute.qualifiedName().toString(),
+                              attribute.value().toString() );
+    }
+  }
+
+  return element;
+}
+
+
+
+// Complete the parsing after all the message has been added
+void SoapStreamParser::finish()
+{
+  if( isFinished_ )
+  {
+    return;
+  }
+
+  parse();
+  isFinished_ = true;
+
+  // A premature end of the document is an error too, now
+  if( reader_.hasError() )
+  {
+    errorString_ = reader_.errorString();
+
+    kWarning() << "XML parsing failed at line" << reader_.lineNumber() << ":" << errorString_ << ".";
+  }
+
+#ifdef KMESSDEBUG_SOAPSTREAMPARSER
+  kDebug() << "Parsed" << reader_.characterOffset() << "characters, valid:" << isValid();
+#endif
+}
+
+
+
+// Return the message body's xml tree
+const QDomNode& SoapStreamParser::getBody() const
+{
+  return body_;
+}
+
+
+
+// Return the parsing error description
+const QString& SoapStreamParser::getErrorString() const
+{
+  return errorString_;
+}
+
+
+
+// Return the xml tree of the fault which was found outside the body
+const QDomNode& SoapStreamParser::getFault() const
+{
+  return fault_;
+}
+
+
+
+// Return the message header's xml tree
+const QDomNode& SoapStreamParser::getHeader() const
+{
+  return header_;
+}
+
+
+
+// Return whether the message has been completely and correctly parsed
+bool SoapStreamParser::isValid() const
+{
+  return ( isFinished_ && errorString_.isEmpty() );
+}
+
+
+
+// Parse as much of the available data as possible
+void SoapStreamParser::parse()
+{
+  while( ! reader_.atEnd() )
+  {
+    switch( reader_.readNext() )
+    {
+      case QXmlStreamReader::StartElement:
+        readStartElement();
+        break;
+
+      case QXmlStreamReader::EndElement:
+        readEndElement();
+        break;
+
+      case QXmlStreamReader::Characters:
+        readCharacters();
+        break;
+
+      case QXmlStreamReader::Invalid:
+        // Either more data is needed, or the document is broken: finish() will tell
+        return;
+
+      default:
+        break;
+    }
+  }
+}
+
+
+
+// Process the characters of the current element
+void SoapStreamParser::readCharacters()
+{
+  // Skipped element
+  if( currentElement_.isNull() )
+  {
+    return;
+  }
+
+  QDomNode lastChild( currentElement_.lastChild() );
+
+  // Text may arrive in more pieces when the data is added in chunks
+  if( lastChild.isText() )
+  {
+    lastChild.toText().appendData( reader_.text().toString() );
+    return;
+  }
+
+  // Like QDomDocument::setContent(), ignore the whitespace between elements
+  if( reader_.isWhitespace() )
+  {
+    return;
+  }
+
+  currentElement_.appendChild( document_.createTextNode( reader_.text().toString() ) );
+}
+
+
+
+// Process the end of the current element
+void SoapStreamParser::readEndElement()
+{
+  if( ! currentElement_.isNull() )
+  {
+    if( depth_ > treeDepth_ )
+    {
+      // Go back to the parent element
+      currentElement_ = currentElement_.parentNode().toElement();
+    }
+    else
+    {
+      // The tree is complete: give extracted elements to the handler, then drop them
+      if( isExtracting_ )
+      {
+        handler_->parseElement( currentElement_ );
+        isExtracting_ = false;
+      }
+
+      currentElement_ = QDomElement();
+    }
+  }
+  else if( depth_ == 2 )
+  {
+    isInBody_ = false;
+  }
+
+  --depth_;
+}
+
+
+
+// Process the start of a new element
+void SoapStreamParser::readStartElement()
+{
+  ++depth_;
+
+  // Add the element to the tree which is being built
+  if( ! currentElement_.isNull() )
+  {
+    currentElement_ = currentElement_.appendChild( createElement() ).toElement();
+    return;
+  }
+
+  const QString name( reader_.name().toString() );
+
+  // The envelope
+  if( depth_ == 1 )
+  {
+    if( name != "Envelope" )
+    {
+      reader_.raiseError( "The message is not a SOAP envelope" );
+      return;
+    }
+
+    document_.appendChild( createElement() );
+    return;
+  }
+
+  // The main envelope blocks
+  if( depth_ == 2 )
+  {
+    if( name == "Header" || name == "Fault" )
+    {
+      // Keep these blocks entirely, they're small
+      currentElement_ = document_.documentElement().appendChild( createElement() ).toElement();
+      treeDepth_      = depth_;
+
+      if( name == "Header" )
+      {
+        header_ = currentElement_;
+      }
+      else
+      {
+        // Faults are found outside the body with the passport RST service
+        fault_ = currentElement_;
+      }
+    }
+    else if( name == "Body" )
+    {
+      body_ = document_.documentElement().appendChild( createElement() );
+
+      if( handler_ == 0 )
+      {
+        // Without a handler, keep the whole body like QDomDocument would
+        currentElement_ = body_.toElement();
+        treeDepth_      = depth_;
+      }
+      else
+      {
+        isInBody_ = true;
+      }
+    }
+
+    return;
+  }
+
+  // Anything else outside the body is not interesting
+  if( ! isInBody_ )
+  {
+    return;
+  }
+
+  // Elements which the handler wants to receive
+  if( elementNames_.contains( name ) )
+  {
+    currentElement_ = createElement();
+    treeDepth_      = depth_;
+    isExtracting_   = true;
+    return;
+  }
+
+  if( depth_ != 3 )
+  {
+    return;
+  }
+
+  // Keep body faults entirely
+  if( name == "Fault" )
+  {
+    currentElement_ = body_.appendChild( createElement() ).toElement();
+    treeDepth_      = depth_;
+    return;
+  }
+
+  // Keep the response node without its children, it tells which kind of response this is
+  if( ! hasResponseNode_ )
+  {
+    body_.appendChild( createElement() );
+    hasResponseNode_ = true;
+  }
+}
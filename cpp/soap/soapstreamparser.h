@@ -0,0 +1,150 @@
+/***************************************************************************
+                          soapstreamparser.h
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef SOAPSTREAMPARSER_H
+#define SOAPSTREAMPARSER_H
+
+#include <QDomDocument>
+#include <QSet>
+#include <QStringList>
+#include <QXmlStreamReader>
+
+
+
+/**
+ * @brief Interface for the classes which process the elements of a streamed SOAP body.
+ *
+ * Services which receive very large responses attach a handler to their request
+ * with SoapMessage::setElementHandler(). The response body is then not kept in memory:
+ * each element with one of the names returned by getElementNames() is extracted from
+ * the body, passed to parseElement(), and discarded.
+ *
+ * The handler is supposed to store the values it needs; the service reads them back when
+ * the complete response has been received.
+ *
+ * parseElement() is called from a SoapParseJob worker thread: a handler must only use its
+ * own data, and must not emit signals or touch the service which created it.
+ *
+ * The handler attached to a request is only a prototype: each SoapParseJob fills its own
+ * copy, made with createEmpty(), so a request which is sent again never mixes the results
+ * of different attempts.
+ *
+ * @ingroup NetworkSoap
+ */
+class SoapElementHandler
+{
+  public:
+    // The destructor
+    virtual             ~SoapElementHandler() {};
+
+    // Return a new handler of the same type, without any results
+    virtual SoapElementHandler *createEmpty() const = 0;
+    // Return the local names of the body elements to extract
+    virtual QStringList  getElementNames() const = 0;
+    // Process an element extracted from the SOAP body
+    virtual void         parseElement( const QDomElement &element ) = 0;
+};
+
+
+
+/**
+ * @brief One-pass parser for SOAP responses.
+ *
+ * This class is an alternative to the QDomDocument based parsing done by SoapMessage::setMessage().
+ * It reads the response with a QXmlStreamReader. Without a SoapElementHandler, it builds
+ * the same tree QDomDocument would. With a handler, it only builds DOM nodes for:
+ * - the <code>Header</code> element;
+ * - the <code>Fault</code> element, either in the envelope or in the body;
+ * - the first element of the body (the <code>...Response</code> node), without its children;
+ * - each body element which the SoapElementHandler asked for, one at a time.
+ *
+ * The rest of the body is skipped, so the memory used does not depend on the size of the response.
+ *
+ * Data can be added in chunks with addData(), as it arrives from the network: HttpSoapConnection
+ * parses each reply while it's being downloaded, and never holds the complete raw response.
+ * Once all data has been added, call finish() and pass the parser to SoapMessage::setMessage().
+ *
+ * @ingroup NetworkSoap
+ */
+class SoapStreamParser
+{
+  public:  // public methods
+    // The constructor
+    explicit             SoapStreamParser( SoapElementHandler *handler = 0 );
+    // The destructor
+    virtual             ~SoapStreamParser();
+
+    // Parse a new chunk of the message
+    void                 addData( const QByteArray &data );
+    // Complete the parsing after all the message has been added
+    void                 finish();
+    // Return the message body's xml tree
+    const QDomNode&      getBody() const;
+    // Return the parsing error description
+    const QString&       getErrorString() const;
+    // Return the xml tree of the fault which was found outside the body
+    const QDomNode&      getFault() const;
+    // Return the message header's xml tree
+    const QDomNode&      getHeader() const;
+    // Return whether the message has been completely and correctly parsed
+    bool                 isValid() const;
+
+  private:  // private methods
+    // Create a DOM element for the current start element
+    QDomElement          createElement();
+    // Parse as much of the available data as possible
+    void                 parse();
+    // Process the characters of the current element
+    void                 readCharacters();
+    // Process the end of the current element
+    void                 readEndElement();
+    // Process the start of a new element
+    void                 readStartElement();
+
+  private:  // private properties
+    // The body node
+    QDomNode             body_;
+    // The element which is being built, null if the current element is skipped
+    QDomElement          currentElement_;
+    // Nesting level of the current element
+    int                  depth_;
+    // Document which owns the created nodes
+    QDomDocument         document_;
+    // Local names of the body elements to extract
+    QSet<QString>        elementNames_;
+    // The parsing error description
+    QString              errorString_;
+    // The fault node found outside the body
+    QDomNode             fault_;
+    // Whether the body response node has been found already
+    bool                 hasResponseNode_;
+    // The object which processes the extracted elements
+    SoapElementHandler  *handler_;
+    // The header node
+    QDomNode             header_;
+    // Whether finish() has been called
+    bool                 isFinished_;
+    // Whether the element which is being built must be passed to the handler
+    bool                 isExtracting_;
+    // Whether the parser is within the body node
+    bool                 isInBody_;
+    // The actual XML parser
+    QXmlStreamReader     reader_;
+    // Nesting level of the root of the element which is being built
+    int                  treeDepth_;
+};
+
+#endif
@@ -0,0 +1,263 @@
+/***************************************************************************
+                          soaptransport.cpp
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "soaptransport.h"
+
+#include "../../kmessdebug.h"
+
+#include <QCoreApplication>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QPointer>
+
+
+#ifdef KMESSDEBUG_HTTPSOAPCONNECTION
+  #define KMESSDEBUG_SOAPTRANSPORT
+#endif
+
+
+/**
+ * @brief Milliseconds after which an idle connection is assumed to be closed by the server
+ */
+#define SOAPTRANSPORT_KEEPALIVE_TIMEOUT   60000
+
+/**
+ * @brief Maximum number of connections Qt opens to a single host
+ *
+ * Further requests wait for one of the open connections.
+ */
+#define SOAPTRANSPORT_MAX_HOST_CONNECTIONS    6
+
+
+
+/**
+ * @brief The constructor
+ *
+ * @param  parent  The application: the transport lives as long as it.
+ */
+SoapTransport::SoapTransport( QObject *parent )
+: QObject( parent )
+, newConnectionCount_( 0 )
+, requestCount_( 0 )
+, preconnectCount_( 0 )
+{
+  manager_ = new QNetworkAccessManager( this );
+
+  connect( manager_, SIGNAL( authenticationRequired(QNetworkReply*,QAuthenticator*) ),
+           this,     SIGNAL( authenticationRequired(QNetworkReply*,QAuthenticator*) ) );
+}
+
+
+
+// The destructor
+SoapTransport::~SoapTransport()
+{
+#ifdef KMESSDEBUG_SOAPTRANSPORT
+  kDebug() << "Sent" << requestCount_ << "requests," << getReusedConnectionCount() << "over reused connections,"
+           << preconnectCount_ << "connections opened in advance.";
+#endif
+}
+
+
+
+// Return the instance of the transport
+SoapTransport *SoapTransport::instance()
+{
+  static QPointer<SoapTransport> transport;
+
+  if( transport.isNull() )
+  {
+    transport = new SoapTransport( QCoreApplication::instance() );
+  }
+
+  return transport;
+}
+
+
+
+// Send a GET request
+QNetworkReply *SoapTransport::get( const QNetworkRequest &request )
+{
+  QNetworkReply *reply = manager_->get( request );
+  trackRequest( reply );
+  return reply;
+}
+
+
+
+// Return the key of a host in the statistics
+QString SoapTransport::getHostKey( const QUrl &url )
+{
+  return url.scheme() + "://" + url.host() + ":" + QString::number( url.port() );
+}
+
+
+
+// Return the number of requests which needed a new connection
+int SoapTransport::getNewConnectionCount() const
+{
+  return newConnectionCount_;
+}
+
+
+
+// Return the number of requests sent so far
+int SoapTransport::getRequestCount() const
+{
+  return requestCount_;
+}
+
+
+
+// Return the number of requests which reused an open connection
+int SoapTransport::getReusedConnectionCount() const
+{
+  return requestCount_ - newConnectionCount_;
+}
+
+
+
+// Return whether a connection to a host is probably open
+bool SoapTransport::hasOpenConnection( const QUrl &url ) const
+{
+  QHash<QString,HostConnections>::const_iterator host( hosts_.constFind( getHostKey( url ) ) );
+  if( host == hosts_.constEnd() || host->openConnections == 0 )
+  {
+    return false;
+  }
+
+  return host->activeReplies > 0 || host->lastActivity.elapsed() <= SOAPTRANSPORT_KEEPALIVE_TIMEOUT;
+}
+
+
+
+// Send a POST request
+QNetworkReply *SoapTransport::post( const QNetworkRequest &request, const QByteArray &data )
+{
+  QNetworkReply *reply = manager_->post( request, data );
+  trackRequest( reply );
+  return reply;
+}
+
+
+
+/**
+ * @brief Open a connection to a host in advance
+ *
+ * A HEAD request is sent to the endpoint, and its reply is discarded: the connection,
+ * with its TLS session, stays open for the next requests. Nothing is sent if a
+ * connection to the host is probably open already.
+ *
+ * @param  request  A request to the endpoint, with the headers of the real requests.
+ */
+void SoapTransport::preconnect( const QNetworkRequest &request )
+{
+  if( hasOpenConnection( request.url() ) )
+  {
+    return;
+  }
+
+#ifdef KMESSDEBUG_SOAPTRANSPORT
+  kDebug() << "Opening a connection to" << request.url().host() << "in advance.";
+#endif
+
+  ++preconnectCount_;
+
+  QNetworkReply *reply = manager_->head( request );
+  trackRequest( reply );
+
+  connect( reply, SIGNAL(    finished() ),
+           reply, SLOT  ( deleteLater() ) );
+}
+
+
+
+// Called when a reply has finished or has been deleted
+void SoapTransport::slotReplyFinished()
+{
+  // Only used as key: the reply may be being destroyed
+  QNetworkReply *reply = static_cast<QNetworkReply*>( sender() );
+
+  if( ! activeReplies_.contains( reply ) )
+  {
+    return;
+  }
+
+  HostConnections &host = hosts_[ activeReplies_.take( reply ) ];
+  --host.activeReplies;
+  host.lastActivity.start();
+}
+
+
+
+/**
+ * @brief Update the connection statistics for a new request
+ *
+ * Qt doesn't tell which connection a request uses, so it is estimated from the
+ * requests in progress: a request needs a new connection when all the connections
+ * to its host are busy, or when they have been idle long enough to be closed.
+ *
+ * @param  reply  The reply of the new request.
+ */
+void SoapTransport::trackRequest( QNetworkReply *reply )
+{
+  const QUrl url( reply->url() );
+  const QString hostKey( getHostKey( url ) );
+
+  if( ! hosts_.contains( hostKey ) )
+  {
+    HostConnections newHost;
+    newHost.activeReplies   = 0;
+    newHost.openConnections = 0;
+    hosts_.insert( hostKey, newHost );
+  }
+
+  HostConnections &host = hosts_[ hostKey ];
+
+  // The server has probably closed the idle connections
+  if( host.activeReplies == 0 && host.lastActivity.elapsed() > SOAPTRANSPORT_KEEPALIVE_TIMEOUT )
+  {
+    host.openConnections = 0;
+  }
+
+  const bool isReused = ( host.activeReplies < host.openConnections
+                       || host.openConnections >= SOAPTRANSPORT_MAX_HOST_CONNECTIONS );
+  if( ! isReused )
+  {
+    ++host.openConnections;
+    ++newConnectionCount_;
+  }
+
+  ++host.activeReplies;
+  ++requestCount_;
+  host.lastActivity.start();
+
+  activeReplies_.insert( reply, hostKey );
+  connect( reply, SIGNAL(          finished() ),
+           this,  SLOT  ( slotReplyFinished() ) );
+  connect( reply, SIGNAL(         destroyed() ),
+           this,  SLOT  ( slotReplyFinished() ) );
+
+#ifdef KMESSDEBUG_SOAPTRANSPORT
+  kDebug() << "Request to" << url.host() << ( isReused ? "reuses a connection" : "opens a new connection" )
+           << "-" << getReusedConnectionCount() << "of" << requestCount_ << "requests reused a connection so far.";
+#endif
+}
+
+
+
+#include "soaptransport.moc"
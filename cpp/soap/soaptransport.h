@@ -0,0 +1,131 @@
+/***************************************************************************
+                          soaptransport.h
+                             -------------------
+    begin                : Sat Oct 17 2026
+    copyright            : (C) 2026 by the KMess team
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef SOAPTRANSPORT_H
+#define SOAPTRANSPORT_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QObject>
+#include <QString>
+#include <QTime>
+
+
+// Forward declarations
+class QAuthenticator;
+class QNetworkAccessManager;
+class QNetworkReply;
+class QNetworkRequest;
+class QUrl;
+
+
+
+/**
+ * @brief The HTTP transport shared by all the web services.
+ *
+ * Qt keeps the connections of a QNetworkAccessManager open between requests, and
+ * reuses them, with their TLS sessions, for the next requests to the same host.
+ * Each service used to create its own manager, so each of them had to open and
+ * secure its own connections to the same few hosts.
+ *
+ * All services send their requests through this object instead, so they share
+ * one manager and its connections. The replies are returned to the caller, who
+ * has to connect to their own signals: the manager signals are common to all
+ * the services. The only exception is authenticationRequired(), which Qt only
+ * fires at the manager level.
+ *
+ * The transport also estimates how many requests could use an already open
+ * connection, and how many needed a new one.
+ *
+ * Services can open a connection to their endpoints with preconnect() before
+ * the first request, so the TCP and TLS handshakes are done in advance.
+ *
+ * @ingroup NetworkSoap
+ */
+class SoapTransport : public QObject
+{
+  Q_OBJECT
+
+  public:  // public static methods
+    // Return the instance of the transport
+    static SoapTransport *instance();
+
+  public:  // public methods
+    // Send a GET request
+    QNetworkReply       *get( const QNetworkRequest &request );
+    // Return the number of requests which needed a new connection
+    int                  getNewConnectionCount() const;
+    // Return the number of requests sent so far
+    int                  getRequestCount() const;
+    // Return the number of requests which reused an open connection
+    int                  getReusedConnectionCount() const;
+    // Send a POST request
+    QNetworkReply       *post( const QNetworkRequest &request, const QByteArray &data );
+    // Open a connection to a host in advance
+    void                 preconnect( const QNetworkRequest &request );
+
+  private:  // private structures
+    // The estimated state of the connections to a host
+    struct HostConnections
+    {
+      // Number of replies still in progress
+      int                activeReplies;
+      // Number of connections which are probably open
+      int                openConnections;
+      // Time since the last request or reply
+      QTime              lastActivity;
+    };
+
+  private:  // private methods
+    // The constructor
+    explicit             SoapTransport( QObject *parent );
+    // The destructor
+    virtual             ~SoapTransport();
+    // Return whether a connection to a host is probably open
+    bool                 hasOpenConnection( const QUrl &url ) const;
+    // Return the key of a host in the statistics
+    static QString       getHostKey( const QUrl &url );
+    // Update the connection statistics for a new request
+    void                 trackRequest( QNetworkReply *reply );
+
+  private slots:
+    // Called when a reply has finished or has been deleted
+    void                 slotReplyFinished();
+
+  private:  // private properties
+    // The state of the connections, by host and port
+    QHash<QString,HostConnections> hosts_;
+    // The host of each reply in progress
+    QHash<QNetworkReply*,QString> activeReplies_;
+    // The shared connection manager
+    QNetworkAccessManager *manager_;
+    // Number of requests which needed a new connection
+    int                  newConnectionCount_;
+    // Number of requests sent
+    int                  requestCount_;
+    // Number of connections opened in advance
+    int                  preconnectCount_;
+
+  signals:
+    /**
+     * @brief Fired when a server asks for HTTP authentication.
+     *
+     * The signal is fired for the requests of all services: check whether the reply is yours.
+     */
+    void                 authenticationRequired( QNetworkReply *reply, QAuthenticator *authenticator );
+};
+
+#endif